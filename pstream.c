@@ -8,14 +8,19 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <float.h>
+#include <math.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 #include <sched.h>
 #include <stdint.h>
 #include <inttypes.h>
-#ifdef USEHUGE
+#include <time.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <sys/mman.h>
-#endif
 #ifdef USENUMA
 #include <numa.h>
 #endif
@@ -45,9 +50,49 @@
 */
 
 #define REPEAT 1
-#define BENCHMARKS 2
-#define MAX_THREADS 1024
-#define MAX_ITER 256
+#define BENCHMARKS 16
+#define MAX_COLUMNS 64
+
+/* long options without a short equivalent */
+#define OPT_ISA 256
+#define OPT_KERNELS 257
+#define OPT_MLP 258
+#define OPT_SEED 259
+#define OPT_TRIALS 260
+#define OPT_COUNTERS 261
+#define OPT_RAW_EVENT 262
+#define OPT_PAGES 263
+#define OPT_PLACEMENT 264
+#define OPT_RESOLUTION 265
+#define OPT_THRESHOLD 266
+#define OPT_BUDGET 267
+#define OPT_TOLERANCE 268
+#define OPT_MAX_TRIALS 269
+#define OPT_THREADS 270
+#define OPT_DETAIL 271
+#define OPT_BARRIER 272
+#define OPT_SPIN_TIMEOUT 273
+#define OPT_PROBES 274
+#define OPT_MAX_DELAY 275
+#define OPT_MIX 276
+#define OPT_STRIDES 277
+#define OPT_GATHER 278
+#define OPT_ENGINES 279
+#define OPT_DAEMON 280
+#define OPT_DUTY 281
+#define OPT_ROUNDS 282
+
+/* kernel instruction set variants, see kernelTable */
+#define ISA_SCALAR 0
+#define ISA_SSE2 1
+#define ISA_AVX2 2
+#define ISA_AVX512 3
+#define ISA_COUNT 4
+
+static char *isaName[ISA_COUNT] = { "scalar", "sse2", "avx2", "avx512" };
+
+int isa = -1;						  /* -1 = pick the best one at startup */
+int ntStores = 0;
 
 struct idThreadParams {
 	int id;
@@ -55,10 +100,62 @@ struct idThreadParams {
 	int maxThreads;
 };
 
-double timeAr[MAX_THREADS][BENCHMARKS * 2];
+/* commands handed to the worker pool */
+#define CMD_STREAM 1
+#define CMD_LATENCY 2
+#define CMD_QUIT 3
+#define CMD_BARRIER 4
+#define CMD_LOADED 5
+#define CMD_ATOMICS 6
+#define CMD_TOUCH 7
+
+/* Memory owned by one worker for the lifetime of the pool.  It is sized
+   for the largest step, first touched by the pinned owner and sliced up
+   for every smaller step. */
+struct threadArena {
+	char *base;
+	int64_t len;
+	int64_t slice;				  /* bytes reserved for each stream array */
+	int pages;					  /* PAGES_* the arena really got */
+	int64_t chain;				  /* length of the latency cycle in it, 0 = none */
+};
+
+struct workCommand {
+	int op;
+	int64_t maxmem;				  /* bytes per thread */
+	long long scale;
+};
+
+/* Long lived pinned workers, created once per thread count.  Each
+   pool_run () bumps the generation, the workers run the command and the
+   last one to finish wakes up main (). */
+struct workerPool {
+	pthread_t *thread;			  /* sized by alloc_tables () */
+	struct idThreadParams *tid;
+	struct threadArena *arena;
+	int threads;
+	int64_t maxmem;				  /* largest bytes per thread the arenas hold */
+	int cpuNode;					  /* run workers on this node, -1 = as usual */
+	int memNode;					  /* bind arenas to this node, -1 = local */
+	int generation;
+	int done;
+	struct workCommand cmd;
+	pthread_mutex_t lock;
+	pthread_cond_t go;
+	pthread_cond_t finished;
+};
+
+double (*timeAr)[BENCHMARKS * 2];
+
+/* thread counts to run, ascending; curStep indexes the one running */
+char *threadSpec = NULL;
+int *schedule;
+int numSteps = 0;
+int curStep;
+double *releaseSkew;				  /* median barrier skew per step, us */
 
 static int shared_cache = 0;
-int minMemory = 500 * 1024 * 1024;
+int64_t minMemory = 500 * 1024 * 1024;
 int64_t maxMemory = 2048ULL * 1024ULL * 1024ULL;
 double timeStep = 0.25;
 int cacheLineSize = 64;		  /* bytes per cacheline */
@@ -75,29 +172,311 @@ int perCacheLine;
 int cacheLinesPerPage;
 int cur_threads;
 int spread=1;
+int numaMatrix = 0;
+/* --loaded: probes workers chase pointers while the rest run the first
+   kernel in LOAD_CHUNK doubles at a time, pausing loadDelay times after
+   each chunk; loadDelay < 0 leaves them idle */
+#define LOAD_CHUNK 512
+int loadedMode = 0;
+int c2cMatrix = 0;				  /* --c2c */
+/* --atomics: every thread hammers fetch-add, CAS and exchange on one
+   shared word, on its own word of one shared line and on its own line */
+#define ATOMIC_FAA 0
+#define ATOMIC_CAS 1
+#define ATOMIC_XCHG 2
+#define ATOMIC_SHARED 0
+#define ATOMIC_LINE 1
+#define ATOMIC_PADDED 2
+static char *atomicOpName[] = { "faa", "cas", "xchg" };
+static char *atomicWhereName[] = { "shared", "line", "padded" };
+int atomicsMode = 0;
+/* 128 bytes so the adjacent line prefetcher doesn't pair them up */
+struct atomicLine {
+	int64_t w[16];
+} __attribute__ ((aligned (128)));
+struct atomicLine *atomicLines; /* [0] is shared, [id + 1] padded */
+/* line: 8 threads to a 64 byte line, [id / 8] so no two share a word */
+struct atomicLine *atomicGroups;
+/* --first-touch: every page kind faulted in by writing a word per 4k,
+   by MAP_POPULATE (mlock for 4k and THP) and by MADV_POPULATE_WRITE, on
+   the local node and on the next one */
+#define TOUCH_WRITE 0
+#define TOUCH_POPULATE 1
+#define TOUCH_MADVISE 2
+#define TOUCH_WAYS 3
+#define TOUCH_SLOTS (4 * TOUCH_WAYS)	/* times the PAGES_* kinds */
+static char *touchName[] = { "touch", "populate", "madvise" };
+static char *touchNodeName[] = { "local", "remote" };
+int firstTouch = 0;
+int touchPlaces = 1;				  /* 2 when there is a remote node */
+int touchRemote;					  /* the placement being run */
+int64_t touchBytes[TOUCH_SLOTS];	  /* bytes faulted in, all threads */
+int touchFailed[TOUCH_SLOTS];		  /* didn't get the page kind asked for */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23	  /* Linux 5.14, older kernels say EINVAL */
+#endif
+/* --daemon: every probeInterval seconds one bandwidth and one latency
+   point per node, probing at most probeDuty percent of the time */
+int daemonMode = 0;
+double probeInterval = 60.0;
+double probeDuty = 1.0;
+long long probeRounds = 0;		  /* 0 = until killed */
+int probes = 1;
+long long maxDelay = 4096;
+long long loadDelay;
+int probesDone;
+double *loadBytes;				  /* bytes each load worker moved */
+/* --adaptive sweep: bisect neighbouring sizes whose first column differs
+   by more than adaptThreshold until they are within adaptResolution */
+int adaptive = 0;
+double adaptResolution = 0.0;	  /* size ratio, 0 = the -i step */
+double adaptThreshold = 0.10;
+double adaptBudget = 0.0;		  /* seconds for the whole run, 0 = no limit */
+int numKernels = 0;
+int engines = 0;					  /* --engines, added once the ISA is known */
+int lineColumns = 0;				  /* 1 adds Mlines/sec after each kernel */
+/* timed regions per command and result columns per data point */
+int numSlots;
+int mlpMax = 0;					  /* most chains per thread, 0 = single chain */
+int numColumns;
+struct column {
+	char *name;
+	char *unit;
+	int higher;					  /* 1 if a bigger value is better */
+	char buf[64];				  /* name when it is made up, so setup_columns ()
+										  can run again without leaking */
+};
+struct column columns[MAX_COLUMNS];
+int trials = 1;					  /* measurements per data point */
+/* keep measuring past trials until the last CONVERGE_WINDOW agree within
+   tolerance, but no more than maxTrials; tolerance 0 turns it off */
+#define CONVERGE_WINDOW 3
+double tolerance = 0.05;
+int maxTrials = 10;
+FILE *statsFile = NULL;
+/* --detail: per thread results and skew of every trial */
+char *detailName = NULL;
+FILE *detailFile = NULL;
+int *threadCpu;					  /* where each worker ran its last command */
 
 int64_t maxmem=0, max_cpu=0;
+/* page size used for every allocation, --pages */
+#define PAGES_4K 0
+#define PAGES_THP 1
+#define PAGES_2M 2
+#define PAGES_1G 3
+static char *pagesName[] = { "4k", "thp", "2m", "1g" };
+#ifdef USEHUGE
+int pages = PAGES_2M;
+#else
+int pages = PAGES_4K;
+#endif
+int pagesGot = -1;				  /* smallest page size any worker ended up with */
+uint64_t seed = 0;				  /* latency chain seed, 0 = pick one at startup */
 
 pthread_mutex_t syncera, syncerb, finisher, counter;
 pthread_mutexattr_t attrib;
 pthread_mutex_t fastmutex = PTHREAD_MUTEX_INITIALIZER;
 double begin_time, end_time;
 long long scale;
+struct workerPool pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+	.go = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER,
+	.cpuNode = -1, .memNode = -1
+};
 
-static char *label[4] = { "Add:       ", "Triad:     ",
+static char *label[4] = { "Start:     ", "Stop:      ",
 	"Cleanup;   "
 };
 
 double begin;
 
-/* crude wall clock time keeping, returns a double of seconds */
+/* monotonic time in seconds, immune to NTP slewing where the raw
+   clock exists */
+#ifdef CLOCK_MONOTONIC_RAW
+#define PSTREAM_CLOCK CLOCK_MONOTONIC_RAW
+#define PSTREAM_CLOCK_NAME "CLOCK_MONOTONIC_RAW"
+#else
+#define PSTREAM_CLOCK CLOCK_MONOTONIC
+#define PSTREAM_CLOCK_NAME "CLOCK_MONOTONIC"
+#endif
+
 double
 second ()
 {
-	struct timeval tp;
-	struct timezone tzp;
-	gettimeofday (&tp, &tzp);
-	return ((double) tp.tv_sec + (double) tp.tv_usec * 1.e-6);
+	struct timespec tp;
+	clock_gettime (PSTREAM_CLOCK, &tp);
+	return ((double) tp.tv_sec + (double) tp.tv_nsec * 1.e-9);
+}
+
+/* resolution of second (), for the output header */
+double
+second_resolution ()
+{
+	struct timespec tp;
+	clock_getres (PSTREAM_CLOCK, &tp);
+	return ((double) tp.tv_sec + (double) tp.tv_nsec * 1.e-9);
+}
+
+/* Optional hardware counters (--counters, --raw-event).  Each worker
+   opens one group on itself, counting user space only, and it is reset
+   and enabled around every timed region.  Events the kernel refuses are
+   dropped at startup so containers and VMs still run. */
+#define MAX_COUNTERS 8
+
+struct counterDesc {
+	char *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+struct counterDesc counterDefaults[] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"LLC-load-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+	 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	{"dTLB-load-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+	 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+struct counterDesc counterTable[MAX_COUNTERS];
+int numCounters = 0;
+int useCounters = 0;
+int (*perfFd)[MAX_COUNTERS];
+/* counts per thread, timed region and event of the last command */
+double (*counterAr)[BENCHMARKS][MAX_COUNTERS];
+
+int
+perf_open (struct counterDesc *cd, int group)
+{
+	struct perf_event_attr pe;
+
+	memset (&pe, 0, sizeof (pe));
+	pe.size = sizeof (pe);
+	pe.type = cd->type;
+	pe.config = cd->config;
+	pe.disabled = (group == -1);
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall (__NR_perf_event_open, &pe, 0, -1, group, 0);
+}
+
+/* add "0x1234,0x5678" raw events to the counter list */
+void
+parse_raw_events (char *list)
+{
+	char *tok, *save = NULL;
+
+	for (tok = strtok_r (list, ",", &save); tok != NULL;
+		  tok = strtok_r (NULL, ",", &save))
+	{
+		if (numCounters == MAX_COUNTERS)
+		{
+			printf ("Sorry, at most %d counters\n", MAX_COUNTERS);
+			exit (-1);
+		}
+		counterTable[numCounters].name = strdup (tok);
+		counterTable[numCounters].type = PERF_TYPE_RAW;
+		counterTable[numCounters].config = strtoull (tok, NULL, 0);
+		numCounters++;
+	}
+	useCounters = 1;
+}
+
+/* drop the events this kernel/CPU won't count, and give up quietly if
+   there's nothing left */
+void
+counters_probe ()
+{
+	int i, fd, n = 0;
+
+	if (!useCounters)
+		return;
+	for (i = 0; i < numCounters; i++)
+	{
+		fd = perf_open (&counterTable[i], -1);
+		if (fd < 0)
+		{
+			printf ("counter %s unavailable (%s), skipping it\n",
+					  counterTable[i].name, strerror (errno));
+			continue;
+		}
+		close (fd);
+		counterTable[n++] = counterTable[i];
+	}
+	numCounters = n;
+	if (numCounters == 0)
+	{
+		printf ("no hardware counters available, continuing without them\n");
+		useCounters = 0;
+	}
+}
+
+void
+counters_open (struct idThreadParams *id)
+{
+	int i;
+
+	if (!useCounters)
+		return;
+	for (i = 0; i < numCounters; i++)
+	{
+		perfFd[id->id][i] = perf_open (&counterTable[i],
+												 i ? perfFd[id->id][0] : -1);
+		if (perfFd[id->id][i] < 0 && i == 0)
+			return;
+	}
+}
+
+void
+counters_close (struct idThreadParams *id)
+{
+	int i;
+
+	for (i = numCounters - 1; i >= 0; i--)
+	{
+		if (perfFd[id->id][i] >= 0)
+			close (perfFd[id->id][i]);
+		perfFd[id->id][i] = -1;
+	}
+}
+
+static inline void
+counters_start (int id)
+{
+	if (!useCounters || perfFd[id][0] < 0)
+		return;
+	ioctl (perfFd[id][0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl (perfFd[id][0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* stop the group and store its counts, scaled up if it was multiplexed */
+static inline void
+counters_stop (int id, int slot)
+{
+	uint64_t buf[3 + MAX_COUNTERS];
+	int i, j;
+
+	if (!useCounters)
+		return;
+	for (i = 0; i < numCounters; i++)
+		counterAr[id][slot][i] = 0.0;
+	if (perfFd[id][0] < 0)
+		return;
+	ioctl (perfFd[id][0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	if (read (perfFd[id][0], buf, sizeof (buf)) < (ssize_t) (3 * sizeof (uint64_t))
+		 || buf[2] == 0)
+		return;
+	/* the group only reads back the members that opened, in order; the
+	   ones that didn't stay 0 */
+	for (i = 0, j = 0; i < numCounters && j < (int) buf[0]; i++)
+	{
+		if (perfFd[id][i] >= 0)
+			counterAr[id][slot][i] = (double) buf[3 + j++] * buf[1] / buf[2];
+	}
 }
 
 #define lui long unsigned int
@@ -130,64 +509,239 @@ align_pointer (int64_t * a1, uint64_t cacheSize, int cacheLineSize, int share,
 	return ((int64_t *) a2);
 }
 
-void *
-sync_thread (int id, char *label)
+/* Thread barriers.  block is the original mutex/condvar barrier, whose
+   release is a chain of kernel wakeups that spreads the start times by
+   tens of microseconds.  spin is a sense-reversing counter barrier the
+   waiters spin on, tree combines arrivals in groups of BARRIER_FANIN so
+   that no counter line is fought over by every thread.  Spinners still
+   waiting after spinTimeout sleep on a condvar instead. */
+#define BARRIER_BLOCK 0
+#define BARRIER_SPIN 1
+#define BARRIER_TREE 2
+static char *barrierName[] = { "block", "spin", "tree" };
+#define BARRIER_FANIN 4
+/* rounds timed by barrier_skew () */
+#define BARRIER_ROUNDS 64
+
+int barrierKind = BARRIER_SPIN;
+int barrierUsed = BARRIER_SPIN;  /* what the running pool uses */
+double spinTimeout = 1.0e-3;
+
+struct barrierNode {
+	int count;
+	int target;
+	int parent;						  /* -1 at the root */
+} __attribute__ ((aligned (64)));
+
+struct barrierNode *barrierTree; /* sized by alloc_tables () */
+double *releaseAr;				  /* [round * threads + id] from barrier_skew */
+static int barrierSense __attribute__ ((aligned (64))) = 0;
+static int barrierSleepers __attribute__ ((aligned (64))) = 0;
+pthread_mutex_t barrierLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t barrierWake = PTHREAD_COND_INITIALIZER;
+static __thread int localSense = 0;
+
+static inline void
+cpu_relax ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause ();
+#endif
+}
+
+/* Lay out the counters for threads arriving with barrier kind.  spin is
+   a single node everybody arrives at, tree has a level of nodes per
+   BARRIER_FANIN-fold.  Called before the workers exist, so the sense
+   can start over for their fresh localSense. */
+void
+barrier_setup (int threads, int kind)
+{
+	int first = 0, n = threads, nodes, fanin, i;
+
+	barrierUsed = kind;
+	barrierSense = 0;
+	fanin = kind == BARRIER_TREE ? BARRIER_FANIN : threads;
+	do
+	{
+		nodes = (n + fanin - 1) / fanin;
+		for (i = 0; i < nodes; i++)
+		{
+			barrierTree[first + i].count = 0;
+			barrierTree[first + i].target = i < nodes - 1 ? fanin : n - i * fanin;
+			barrierTree[first + i].parent = nodes > 1 ? first + nodes + i / fanin : -1;
+		}
+		first = first + nodes;
+		n = nodes;
+	}
+	while (n > 1);
+}
+
+void
+barrier_block ()
 {
 	static int counter = 0;
+	static int generation = 0;	  /* bumped by the last one in */
 	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 	static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	int mine;
 
 	pthread_mutex_lock (&mutex);
+	mine = generation;
 	counter = counter + 1;
 
 	/* for this to be true all threads must be waiting here */
 	if (counter < cur_threads)
 	{
-		pthread_cond_wait (&cond, &mutex);
+		/* a spurious wakeup must not let anyone out early */
+		while (generation == mine)
+			pthread_cond_wait (&cond, &mutex);
 	}
 	else
 	{
-		pthread_cond_broadcast (&cond);
 		counter = 0;
+		generation++;
+		pthread_cond_broadcast (&cond);
 	}
 	pthread_mutex_unlock (&mutex);
-	return (NULL);
 }
 
+/* The last thread to reach a node goes on to its parent, the last one at
+   the root flips the sense everybody else is spinning on. */
 void
-swap (int64_t * a, int64_t x, int64_t y)
+barrier_spin (int id)
+{
+	struct barrierNode *node;
+	int sense = localSense = !localSense;
+	long spins = 0;
+	double start = 0.0;
+
+	node = &barrierTree[barrierUsed == BARRIER_TREE ? id / BARRIER_FANIN : 0];
+	while (__atomic_add_fetch (&node->count, 1, __ATOMIC_ACQ_REL) ==
+			 node->target)
+	{
+		__atomic_store_n (&node->count, 0, __ATOMIC_RELAXED);
+		if (node->parent < 0)
+		{
+			__atomic_store_n (&barrierSense, sense, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n (&barrierSleepers, __ATOMIC_SEQ_CST))
+			{
+				pthread_mutex_lock (&barrierLock);
+				pthread_cond_broadcast (&barrierWake);
+				pthread_mutex_unlock (&barrierLock);
+			}
+			return;
+		}
+		node = &barrierTree[node->parent];
+	}
+	while (__atomic_load_n (&barrierSense, __ATOMIC_ACQUIRE) != sense)
+	{
+		cpu_relax ();
+		if ((++spins & 1023) != 0)
+			continue;
+		if (start == 0.0)
+			start = second ();
+		else if (second () - start > spinTimeout)
+		{
+			/* the releaser checks for sleepers after flipping the sense,
+			   so either it sees us or we see the new sense */
+			pthread_mutex_lock (&barrierLock);
+			__atomic_add_fetch (&barrierSleepers, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n (&barrierSense, __ATOMIC_SEQ_CST) != sense)
+				pthread_cond_wait (&barrierWake, &barrierLock);
+			__atomic_sub_fetch (&barrierSleepers, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock (&barrierLock);
+			return;
+		}
+	}
+}
+
+void *
+sync_thread (int id, char *label)
 {
-	int64_t t;
-	t = a[x];
-	a[x] = a[y];
-	a[y] = t;
+	if (barrierUsed == BARRIER_BLOCK)
+		barrier_block ();
+	else
+		barrier_spin (id);
+	return (NULL);
 }
 
-/* choose between l and h, inclusive of both. */
+/* Small per-thread PRNG (xorshift64*), seeded through splitmix64 so
+   neighbouring thread ids get unrelated streams. */
 uint64_t
-choose (uint64_t l, uint64_t h)
+rng_seed (uint64_t seed, int id)
 {
-	uint64_t range, smallr, ret;
+	uint64_t z = seed + 0x9e3779b97f4a7c15ULL * (uint64_t) (id + 1);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z = z ^ (z >> 31);
+	return z ? z : 1;
+}
 
-	range = h - l;
-	assert (l <= h);
-	smallr = range / perCacheLine;	/* the number of cachelines in
-												   the range */
-	if (numPages > 0)
-	{
-		if (smallr > cacheLinesPerPage * numPages)
-			smallr = cacheLinesPerPage * numPages;
-	}
-	/* pick a cache line within the range */
-	ret = (l + (uint64_t) (drand48 () * smallr) * perCacheLine);
-/*  printf ("l=%lld h=%lld ret=%lld\n",l,h,ret);  */
-	assert (ret <= h);
-	if (l < h)
-		return ret;
-	return h;
+static inline uint64_t
+rng_next (uint64_t * state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniform in [0, n) */
+static inline uint64_t
+rng_below (uint64_t * state, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+	return (uint64_t) (((unsigned __int128) rng_next (state) * n) >> 64);
+#else
+	return rng_next (state) % n;
+#endif
 }
 
+/* Link the first size / perCacheLine cache lines of a into one random
+   cycle through index 0, each line holding the index of the next.  With
+   -p the lines are cut into windows of numPages pages, Sattolo's
+   algorithm makes each window a random cycle, and each window is spliced
+   in just before the walk gets back to 0, so the cycle still visits each
+   window in one go, in order. */
+void
+build_cycle (int64_t * a, int64_t size, uint64_t * rng)
+{
+	int64_t lines, window, lo, hi, i, j, t, tail = 0;
 
+	lines = size / perCacheLine;
+	window = lines;
+	if (numPages > 0 && (int64_t) cacheLinesPerPage * numPages < lines)
+		window = (int64_t) cacheLinesPerPage * numPages;
+	for (lo = 0; lo < lines; lo = hi)
+	{
+		hi = lo + window < lines ? lo + window : lines;
+		for (i = lo; i < hi; i++)
+			a[i * perCacheLine] = i * perCacheLine;
+		for (i = hi - 1; i > lo; i--)
+		{
+			j = lo + rng_below (rng, i - lo);
+			t = a[i * perCacheLine];
+			a[i * perCacheLine] = a[j * perCacheLine];
+			a[j * perCacheLine] = t;
+		}
+		if (lo == 0 && hi < lines)
+		{
+			/* the line that closes the first window back to 0 */
+			for (tail = 0; a[tail * perCacheLine] != 0; tail++);
+		}
+		else if (lo > 0)
+		{
+			/* tail -> the window's cycle from lo's successor round to lo,
+			   lo -> 0, and lo is the new tail */
+			t = a[tail * perCacheLine];
+			a[tail * perCacheLine] = a[lo * perCacheLine];
+			a[lo * perCacheLine] = t;
+			tail = lo;
+		}
+	}
+}
 
 int
 logint (int l /* 32-bit word to find the log base 2 of */ )
@@ -209,10 +763,10 @@ logint (int l /* 32-bit word to find the log base 2 of */ )
 }
 
 int
-follow_ar (int64_t * a, int64_t N, int repeat)
+follow_ar (int64_t * a, int64_t N, long long repeat)
 {
 	int64_t p = 0;
-	int i;
+	long long i;
 #ifdef CNT
 	int cnt;
 	cnt = 0;
@@ -237,133 +791,1042 @@ follow_ar (int64_t * a, int64_t N, int repeat)
 }
 
 
+/* Memory level parallelism: walk K independent chains through the same
+   buffer, one hop of each per step, so up to K misses can be in flight.
+   Generated per K so the chain heads stay in registers. */
+#define MAX_CHAINS 32
+
+#define FOLLOW_MLP(K) \
+int64_t \
+follow_mlp_##K (int64_t * a, int64_t * start, int64_t steps, long long repeat) \
+{ \
+	int64_t p[K], s, t = 0; \
+	long long r; \
+	int j; \
+	for (r = 0; r < repeat; r++) \
+	{ \
+		for (j = 0; j < K; j++) \
+			p[j] = start[j]; \
+		for (s = 0; s < steps; s++) \
+		{ \
+			for (j = 0; j < K; j++) \
+				p[j] = a[p[j]]; \
+		} \
+		for (j = 0; j < K; j++) \
+			t += p[j]; \
+	} \
+	return t; \
+}
+
+FOLLOW_MLP (1)
+FOLLOW_MLP (2)
+FOLLOW_MLP (4)
+FOLLOW_MLP (8)
+FOLLOW_MLP (16)
+FOLLOW_MLP (32)
+
+/* indexed by log2 (K) */
+int64_t (*follow_mlp[]) (int64_t *, int64_t *, int64_t, long long) =
+{
+follow_mlp_1, follow_mlp_2, follow_mlp_4, follow_mlp_8, follow_mlp_16,
+		follow_mlp_32};
+
+/* CPU topology from /sys/devices/system/cpu, restricted to the cpus the
+   process inherited (taskset, cgroup cpusets).  Thread id N runs on
+   placeOrder[N] under a --placement policy. */
+#define PLACE_NONE 0
+#define PLACE_COMPACT 1
+#define PLACE_SOCKET 2
+#define PLACE_L3 3
+#define PLACE_CORE 4
+#define PLACE_SMT 5
+static char *placeName[] = { "none", "compact", "socket", "l3", "core", "smt" };
+
+struct cpuInfo {
+	int cpu;
+	int package;
+	int core;
+	int l3;						  /* lowest cpu sharing this cpu's L3 */
+	int smt;						  /* 0 for the first hw thread of a core */
+	int rank;					  /* position within the domain being scattered over */
+};
+
+struct cpuInfo *topo = NULL;
+int numCpus = 0;
+int placement = PLACE_NONE;
+int *placeOrder = NULL;
+int placeCount = 0;
+int64_t l3Size = 0;				  /* bytes of one L3 domain, 0 if unknown */
+
+/* read the first integer from a sysfs file, -1 if it isn't there */
+int64_t
+sysfs_int (char *fmt, int cpu, int index)
+{
+	char path[256];
+	FILE *fp;
+	long long v = -1;
+
+	snprintf (path, sizeof (path), fmt, cpu, index);
+	fp = fopen (path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fscanf (fp, "%lld", &v) != 1)
+		v = -1;
+	fclose (fp);
+	return v;
+}
+
+/* the L3 a cpu sits in: its lowest sharing cpu and the size in bytes */
+int
+sysfs_l3 (int cpu, int64_t * size)
+{
+	char path[256], buf[64];
+	FILE *fp;
+	int index, first = cpu;
+	long long kb;
+
+	for (index = 0; index < 8; index++)
+	{
+		if (sysfs_int ("/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+							cpu, index) != 3)
+			continue;
+		snprintf (path, sizeof (path),
+					 "/sys/devices/system/cpu/cpu%d/cache/index%d/size", cpu,
+					 index);
+		fp = fopen (path, "r");
+		if (fp != NULL)
+		{
+			if (fscanf (fp, "%lld%63s", &kb, buf) >= 1)
+				*size = kb * (buf[0] == 'M' ? 1024 * 1024 : 1024);
+			fclose (fp);
+		}
+		/* shared_cpu_list starts with the lowest cpu, e.g. "0-7,64-71" */
+		first = sysfs_int
+			("/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu,
+			 index);
+		if (first < 0)
+			first = cpu;
+		break;
+	}
+	return first;
+}
+
+int
+compare_topo (const void *x, const void *y)
+{
+	const struct cpuInfo *a = x, *b = y;
+
+	switch (placement)
+	{
+	case PLACE_SOCKET:
+	case PLACE_L3:
+		/* physical cores first, then deal round robin over the domains */
+		if (a->smt != b->smt)
+			return a->smt - b->smt;
+		if (a->rank != b->rank)
+			return a->rank - b->rank;
+		if (a->package != b->package)
+			return a->package - b->package;
+		return a->l3 - b->l3;
+	case PLACE_CORE:
+	case PLACE_SMT:
+		if (a->package != b->package)
+			return a->package - b->package;
+		if (a->l3 != b->l3)
+			return a->l3 - b->l3;
+		if (a->core != b->core)
+			return a->core - b->core;
+		return a->smt - b->smt;
+	}
+	return a->cpu - b->cpu;
+}
+
+void
+read_topology ()
+{
+	cpu_set_t cset;
+	int cpu, i, j;
+	int64_t size = 0;
+
+	CPU_ZERO (&cset);
+	sched_getaffinity (0, sizeof (cpu_set_t), &cset);
+	topo = calloc (CPU_SETSIZE, sizeof (struct cpuInfo));
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET (cpu, &cset))
+			continue;
+		topo[numCpus].cpu = cpu;
+		topo[numCpus].package = sysfs_int
+			("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu, 0);
+		topo[numCpus].core = sysfs_int
+			("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, 0);
+		topo[numCpus].l3 = sysfs_l3 (cpu, &size);
+		if (l3Size == 0)
+			l3Size = size;
+		numCpus++;
+	}
+	/* number hw threads within each core */
+	for (i = 0; i < numCpus; i++)
+	{
+		for (j = 0; j < i; j++)
+		{
+			if (topo[j].package == topo[i].package
+				 && topo[j].core == topo[i].core)
+				topo[i].smt++;
+		}
+	}
+}
+
+/* build placeOrder for the chosen policy */
+void
+place_threads ()
+{
+	int i, j;
+
+	for (i = 0; i < numCpus; i++)
+	{
+		/* how many cpus of the same kind come before this one in its
+		   package (socket) or L3 (l3) */
+		topo[i].rank = 0;
+		for (j = 0; j < numCpus; j++)
+		{
+			if (topo[j].smt != topo[i].smt || j == i)
+				continue;
+			if (placement == PLACE_SOCKET && topo[j].package == topo[i].package
+				 && (topo[j].l3 < topo[i].l3 || (topo[j].l3 == topo[i].l3
+														&& topo[j].core < topo[i].core)))
+				topo[i].rank++;
+			if (placement == PLACE_L3 && topo[j].l3 == topo[i].l3
+				 && topo[j].package == topo[i].package
+				 && topo[j].core < topo[i].core)
+				topo[i].rank++;
+		}
+	}
+	qsort (topo, numCpus, sizeof (struct cpuInfo), compare_topo);
+	placeOrder = malloc (sizeof (int) * numCpus);
+	placeCount = 0;
+	for (i = 0; i < numCpus; i++)
+	{
+		if (placement == PLACE_CORE && topo[i].smt != 0)
+			continue;
+		placeOrder[placeCount++] = topo[i].cpu;
+	}
+	/* only SMT siblings allowed, one per core is none at all */
+	if (placeCount == 0 && numCpus > 0)
+	{
+		printf ("No first thread of a core is allowed, placing on every cpu\n");
+		for (i = 0; i < numCpus; i++)
+			placeOrder[placeCount++] = topo[i].cpu;
+	}
+}
+
 #ifdef USEAFFINITY
+/* run the calling thread on cpu only */
+int
+pin_cpu (int cpu)
+{
+	cpu_set_t cset;
+
+	CPU_ZERO (&cset);
+	CPU_SET (cpu, &cset);
+	return sched_setaffinity (0, sizeof (cpu_set_t), &cset);
+}
+
 void
 set_affinity (struct idThreadParams *id)
 {
-	cpu_set_t cset;
 /*	printf ("id=%d affinity=%d affinity_wide=%d\n",id,affinity,affinity_wide); */
 	int aid=id->id;
 	// Allow spread at constant intervals.
 	if (affinity_wide && spread>1) {
 		aid= ((aid%spread) * max_cpu/spread) + aid/spread;
 	}
-	
-	sched_getaffinity (0, sizeof (cpu_set_t), &cset);
-	CPU_ZERO (&cset);
-	CPU_SET (aid, &cset);
-	sched_setaffinity (0, sizeof (cpu_set_t), &cset);
+	else if (placement != PLACE_NONE && placeCount > 0)
+	{
+		/* more threads than cpus in the policy wrap around */
+		aid = placeOrder[aid % placeCount];
+	}
+
+	pin_cpu (aid);
 }
 #endif
 
-void *
-latency_thread (void *arg)
+/* one timed region per K = 1, 2, 4 .. mlpMax over the chain in a */
+void
+latency_mlp (struct idThreadParams *id, int64_t * a, int64_t size)
 {
-	struct idThreadParams *id = arg;
-	int64_t *a;
-	int64_t *aa = NULL;
-	int64_t x, y;
-	int64_t i, c;
-	int64_t size, len = 0;
+	int64_t head[MAX_CHAINS], start[MAX_CHAINS];
+	int64_t lines, gap, p, i;
+	int k, j, K;
 
-#ifdef USEAFFINITY
-	if (affinity)
-		set_affinity (id);
-#endif
-	size = maxmem / sizeof (int64_t);
-	if (usenuma)
+	/* heads spaced evenly along the cycle, found by walking it once */
+	lines = size / perCacheLine;
+	gap = lines / mlpMax;
+	p = 0;
+	for (j = 0; j < mlpMax; j++)
 	{
-#ifdef USENUMA
-		numa_run_on_node (id->id % id->maxThreads);
-		aa =
-			numa_alloc_local (size * sizeof (int64_t) + 2 * cacheSize +
-									2 * cacheLineSize);
-#endif
+		head[j] = p;
+		for (i = 0; i < gap; i++)
+			p = a[p];
 	}
-	else
+	for (k = 0; k < numSlots; k++)
 	{
-		len = (size * sizeof (uint64_t) + 2 * cacheSize + 2 * cacheLineSize);
-#ifdef USEHUGE
-		len = (len + 2097151) & ~2097151;
-		aa = mmap (0, len, PROT_READ | PROT_WRITE,
-					  MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
-		if (aa == MAP_FAILED)
-		{
-			printf ("Warning memory allocation of %" PRIu64 " MB array failed\n",
-					  len/ (1024 * 1024));
-			exit (-1);
-		}
+		K = 1 << k;
+		/* chain j of K starts at head j * mlpMax / K */
+		for (j = 0; j < K; j++)
+			start[j] = head[j * (mlpMax / K)];
+		sync_thread (id->id, label[0]);
+		counters_start (id->id);
+		timeAr[id->id][k * 2] = second ();
+		if (gap > 0)
+			follow_mlp[k] (a, start, lines / K, pool.cmd.scale);
+		timeAr[id->id][k * 2 + 1] = second ();
+		counters_stop (id->id, k);
+	}
+	sync_thread (id->id, label[1]);
+}
 
+void *
+latency_thread (void *arg)
+{
+	struct idThreadParams *id = arg;
+	int64_t *a;
+	int64_t size;
+	uint64_t rng;
 
-#else
-		aa = (int64_t *) malloc (len);
-#endif
-	}
-	/* allocate the entire cache */
-/*	a = (int64_t *) align_pointer (aa, cacheSize, cacheLineSize, 1, 0); */
-	a = aa;
+	size = pool.cmd.maxmem / sizeof (int64_t);
+	/* use the whole arena, no cache alignment */
+	a = (int64_t *) pool.arena[id->id].base;
 #ifdef DEBUG
-	printf ("aa=%p a=%p d=%d align=%d t=%d\n",
-			  aa, a, (int64_t) ((int64_t) a - (int64_t) aa),
-			  ((int64_t) (a)) % (cacheSize), id.id);
+	printf ("a=%p align=%d t=%d\n", a, ((int64_t) (a)) % (cacheSize), id->id);
 #endif /* debug */
 
-	srand48 ((long int) getpid ());
-	for (i = 0; i < size; i = i + perCacheLine)
+	/* calibration and the trials of a point all walk the same cycle */
+	if (pool.arena[id->id].chain != size)
 	{
-		a[i] = i + perCacheLine;	/* assign each int the index of the next int */
+		rng = rng_seed (seed, id->id);
+		build_cycle (a, size, &rng);
+		pool.arena[id->id].chain = size;
 	}
-	a[(i - perCacheLine)] = 0;	/* makes the array a loop */
 #if DEBUG
 	printAr (a, size);
 #endif
-	for (i = 0; i < (size - perCacheLine); i = i + perCacheLine)
+	if (mlpMax)
 	{
-		c = choose (i, size - perCacheLine);
-		if (c > (size - perCacheLine))
-		{
-			printf ("this should never happen *****************\n");
-		}
-		x = a[i];
-		y = a[c];
-		swap (a, i, c);
-		swap (a, x, y);
+		latency_mlp (id, a, size);
+		return NULL;
 	}
-#if DEBUG
-	printAr (a, size);
-#endif
 	sync_thread (id->id, label[0]);
+	counters_start (id->id);
 	timeAr[id->id][0] = second ();
-	follow_ar (a, size, scale);
+	follow_ar (a, size, pool.cmd.scale);
 	timeAr[id->id][1] = second ();
+	counters_stop (id->id, 0);
 	sync_thread (id->id, label[1]);
-#if DEBUG
-	printf ("synced numa=%d\n", usenuma);
-#endif
-/*	sync_thread (id, label[2]); */
-	if (usenuma)
+	return NULL;
+}
+
+
+/* Stream kernels.  Every kernel exists as a plain C loop and, on x86, as
+   hand vectorized SSE2, AVX2 and AVX-512 versions so the results do not
+   depend on what the compiler decided to vectorize.  The variant is picked
+   at runtime from CPUID (or forced with --isa), and ntStores switches the
+   vector versions to non-temporal stores that bypass write-allocate. */
+typedef double (*kernel_fn) (double *d, double *x, double *y, double s,
+									  int64_t n);
+/* mix:R:W, reads R and writes W pieces of MIX_UNIT doubles of d in turn */
+typedef double (*mix_fn) (double *d, int64_t n, int reads, int writes,
+								  double s);
+#define MIX_UNIT 128
+
+#define SCALAR_STORE_KERNEL(kname, SEXPR) \
+static double \
+kname##_scalar (double *d, double *x, double *y, double s, int64_t n) \
+{ \
+	int64_t i; \
+	for (i = 0; i < n; i++) \
+		d[i] = SEXPR; \
+	return 0.0; \
+}
+
+SCALAR_STORE_KERNEL (copy, x[i])
+SCALAR_STORE_KERNEL (scale, s * x[i])
+SCALAR_STORE_KERNEL (add, x[i] + y[i])
+SCALAR_STORE_KERNEL (triad, x[i] + s * y[i])
+SCALAR_STORE_KERNEL (fill, s)
+SCALAR_STORE_KERNEL (rmw, d[i] + s)
+
+static double
+sum_scalar (double *d, double *x, double *y, double s, int64_t n)
+{
+	int64_t i;
+	double t0 = 0.0, t1 = 0.0, t2 = 0.0, t3 = 0.0;
+
+	/* four independent accumulators so the adds do not serialize */
+	for (i = 0; i + 4 <= n; i += 4)
 	{
-#ifdef USENUMA
-		numa_free (aa, size * sizeof (int64_t) + cacheSize);
-#endif
+		t0 += x[i];
+		t1 += x[i + 1];
+		t2 += x[i + 2];
+		t3 += x[i + 3];
 	}
-	else
+	for (; i < n; i++)
+		t0 += x[i];
+	return t0 + t1 + t2 + t3;
+}
+
+static double
+mix_scalar (double *d, int64_t n, int reads, int writes, double s)
+{
+	int64_t i = 0, end;
+	double t0 = 0.0, t1 = 0.0, t2 = 0.0, t3 = 0.0;
+	int u;
+
+	while (i < n)
 	{
-#ifdef USEHUGE
-		munmap (aa, len);
+		for (u = 0; u < reads && i < n; u++)
+		{
+			end = n - i < MIX_UNIT ? n : i + MIX_UNIT;
+			/* four sums in flight, as in sum_scalar () */
+			for (; i + 4 <= end; i += 4)
+			{
+				t0 += d[i];
+				t1 += d[i + 1];
+				t2 += d[i + 2];
+				t3 += d[i + 3];
+			}
+			for (; i < end; i++)
+				t0 += d[i];
+		}
+		for (u = 0; u < writes && i < n; u++)
+		{
+			end = n - i < MIX_UNIT ? n : i + MIX_UNIT;
+			for (; i < end; i++)
+				d[i] = s;
+		}
+	}
+	return t0 + t1 + t2 + t3;
+}
+
+/* libc, as most bytes get moved */
+static double
+memcpy_scalar (double *d, double *x, double *y, double s, int64_t n)
+{
+	memcpy (d, x, n * sizeof (double));
+	return 0.0;
+}
+
+static double
+memset_scalar (double *d, double *x, double *y, double s, int64_t n)
+{
+	memset (d, 0, n * sizeof (double));
+	return 0.0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* d[i] = SEXPR, W doubles at a time as VEXPR once d is vector aligned,
+   with streaming stores if nt (--nt for the kernel itself) */
+#define SIMD_STORE_KERNEL(kname, isa, tgt, vtype, W, ST, NT, SET1, VEXPR, SEXPR) \
+static inline double __attribute__ ((target (tgt), always_inline)) \
+kname##_##isa##_body (double *d, double *x, double *y, double s, int64_t n, \
+							 int nt) \
+{ \
+	int64_t i = 0; \
+	vtype vs = SET1 (s); \
+	(void) vs; \
+	for (; i < n && ((uintptr_t) (d + i) & (W * sizeof (double) - 1)); i++) \
+		d[i] = SEXPR; \
+	if (nt) \
+	{ \
+		for (; i + W <= n; i += W) \
+			NT (d + i, VEXPR); \
+		_mm_sfence (); \
+	} \
+	else \
+	{ \
+		for (; i + W <= n; i += W) \
+			ST (d + i, VEXPR); \
+	} \
+	for (; i < n; i++) \
+		d[i] = SEXPR; \
+	return 0.0; \
+} \
+static double __attribute__ ((target (tgt))) \
+kname##_##isa (double *d, double *x, double *y, double s, int64_t n) \
+{ \
+	return kname##_##isa##_body (d, x, y, s, n, ntStores); \
+}
+
+/* copy and fill with the store kind fixed, for the copy engines */
+#define SIMD_ENGINE(ename, kname, isa, tgt, nt) \
+static double __attribute__ ((target (tgt))) \
+ename##_##isa (double *d, double *x, double *y, double s, int64_t n) \
+{ \
+	return kname##_##isa##_body (d, x, y, s, n, nt); \
+}
+
+/* four independent accumulators so the adds do not serialize */
+#define SIMD_SUM_KERNEL(isa, tgt, vtype, W, LD, SET1, ADD, STU) \
+static double __attribute__ ((target (tgt))) \
+sum_##isa (double *d, double *x, double *y, double s, int64_t n) \
+{ \
+	int64_t i = 0, j; \
+	double t = 0.0, lane[W]; \
+	vtype v0 = SET1 (0.0), v1 = v0, v2 = v0, v3 = v0; \
+	for (; i + 4 * W <= n; i += 4 * W) \
+	{ \
+		v0 = ADD (v0, LD (x + i)); \
+		v1 = ADD (v1, LD (x + i + W)); \
+		v2 = ADD (v2, LD (x + i + 2 * W)); \
+		v3 = ADD (v3, LD (x + i + 3 * W)); \
+	} \
+	STU (lane, ADD (ADD (v0, v1), ADD (v2, v3))); \
+	for (j = 0; j < W; j++) \
+		t += lane[j]; \
+	for (; i < n; i++) \
+		t += x[i]; \
+	return t; \
+}
+
+/* the pieces inline, four sums in flight; streaming stores are fenced
+   once per pass rather than per piece.  Misaligned d is left to the C
+   loops, the stores here are aligned ones. */
+#define SIMD_MIX_KERNEL(isa, tgt, vtype, W, LD, ST, NT, SET1, ADD, STU) \
+static double __attribute__ ((target (tgt))) \
+mix_##isa (double *d, int64_t n, int reads, int writes, double s) \
+{ \
+	int64_t i = 0, j, end; \
+	double t = 0.0, lane[W]; \
+	vtype v0 = SET1 (0.0), v1 = v0, v2 = v0, v3 = v0, vs = SET1 (s); \
+	int u; \
+	if ((uintptr_t) d & (W * sizeof (double) - 1)) \
+		return mix_scalar (d, n, reads, writes, s); \
+	while (i < n) \
+	{ \
+		for (u = 0; u < reads && i < n; u++) \
+		{ \
+			end = n - i < MIX_UNIT ? n : i + MIX_UNIT; \
+			for (; i + 4 * W <= end; i += 4 * W) \
+			{ \
+				v0 = ADD (v0, LD (d + i)); \
+				v1 = ADD (v1, LD (d + i + W)); \
+				v2 = ADD (v2, LD (d + i + 2 * W)); \
+				v3 = ADD (v3, LD (d + i + 3 * W)); \
+			} \
+			for (; i < end; i++) \
+				t += d[i]; \
+		} \
+		for (u = 0; u < writes && i < n; u++) \
+		{ \
+			end = n - i < MIX_UNIT ? n : i + MIX_UNIT; \
+			if (ntStores) \
+			{ \
+				for (; i + W <= end; i += W) \
+					NT (d + i, vs); \
+			} \
+			else \
+			{ \
+				for (; i + W <= end; i += W) \
+					ST (d + i, vs); \
+			} \
+			for (; i < end; i++) \
+				d[i] = s; \
+		} \
+	} \
+	if (ntStores) \
+		_mm_sfence (); \
+	STU (lane, ADD (ADD (v0, v1), ADD (v2, v3))); \
+	for (j = 0; j < W; j++) \
+		t += lane[j]; \
+	return t; \
+}
+
+#define SIMD_KERNELS(isa, tgt, vtype, W, LD, ST, NT, SET1, ADD, MUL, STU) \
+SIMD_STORE_KERNEL (copy, isa, tgt, vtype, W, ST, NT, SET1, \
+						 LD (x + i), x[i]) \
+SIMD_STORE_KERNEL (scale, isa, tgt, vtype, W, ST, NT, SET1, \
+						 MUL (vs, LD (x + i)), s * x[i]) \
+SIMD_STORE_KERNEL (add, isa, tgt, vtype, W, ST, NT, SET1, \
+						 ADD (LD (x + i), LD (y + i)), x[i] + y[i]) \
+SIMD_STORE_KERNEL (triad, isa, tgt, vtype, W, ST, NT, SET1, \
+						 ADD (LD (x + i), MUL (vs, LD (y + i))), x[i] + s * y[i]) \
+SIMD_STORE_KERNEL (fill, isa, tgt, vtype, W, ST, NT, SET1, vs, s) \
+SIMD_STORE_KERNEL (rmw, isa, tgt, vtype, W, ST, NT, SET1, \
+						 ADD (LD (d + i), vs), d[i] + s) \
+SIMD_SUM_KERNEL (isa, tgt, vtype, W, LD, SET1, ADD, STU) \
+SIMD_MIX_KERNEL (isa, tgt, vtype, W, LD, ST, NT, SET1, ADD, STU) \
+SIMD_ENGINE (vcopy, copy, isa, tgt, 0) \
+SIMD_ENGINE (ntcopy, copy, isa, tgt, 1) \
+SIMD_ENGINE (vfill, fill, isa, tgt, 0) \
+SIMD_ENGINE (ntfill, fill, isa, tgt, 1)
+
+SIMD_KERNELS (sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_store_pd,
+				  _mm_stream_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd, _mm_storeu_pd)
+SIMD_KERNELS (avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_store_pd,
+				  _mm256_stream_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_mul_pd,
+				  _mm256_storeu_pd)
+SIMD_KERNELS (avx512, "avx512f", __m512d, 8, _mm512_loadu_pd,
+				  _mm512_store_pd, _mm512_stream_pd, _mm512_set1_pd,
+				  _mm512_add_pd, _mm512_mul_pd, _mm512_storeu_pd)
+#define SIMD_VARIANTS(kname) \
+	{ kname##_scalar, kname##_sse2, kname##_avx2, kname##_avx512 }
+#define ENGINE_VARIANTS(ename, kname) \
+	{ kname##_scalar, ename##_sse2, ename##_avx2, ename##_avx512 }
+
+/* the string instructions, fast on ERMS parts */
+static double
+movsb_scalar (double *d, double *x, double *y, double s, int64_t n)
+{
+	size_t bytes = n * sizeof (double);
+	__asm__ volatile ("rep movsb":"+D" (d), "+S" (x), "+c" (bytes)::"memory");
+	return 0.0;
+}
+
+static double
+stosb_scalar (double *d, double *x, double *y, double s, int64_t n)
+{
+	size_t bytes = n * sizeof (double);
+	__asm__ volatile ("rep stosb":"+D" (d), "+c" (bytes):"a" (0):"memory");
+	return 0.0;
+}
 #else
-		free (aa);
+#define SIMD_VARIANTS(kname) { kname##_scalar, NULL, NULL, NULL }
+#define ENGINE_VARIANTS(ename, kname) { kname##_scalar, NULL, NULL, NULL }
+#define movsb_scalar memcpy_scalar
+#define stosb_scalar memset_scalar
 #endif
+/* the same function whatever the ISA */
+#define ANY_ISA(fname) { fname, fname, fname, fname }
+
+/* arrays is how many arrays of the current size one call streams (for
+   bytes moved), d, x and y pick which of a, b and c the kernel is
+   handed.  A mix kernel has no fn, it reads reads and writes writes
+   MIX_UNIT pieces in turn with sum and fill.  A stride kernel sums
+   every stride'th double of each array, gather and scatter move b to a
+   through an index of order INDEX_* kept in c. */
+struct kernelDesc {
+	char *name;
+	int arrays;
+	int d, x, y;
+	kernel_fn fn[ISA_COUNT];
+	int reads, writes;
+	int stride;
+	int indexed;					  /* INDEXED_GATHER or INDEXED_SCATTER */
+	int order;
+	int engine;						  /* ENGINE_COPY, ENGINE_FILL or 0 */
+};
+
+#define ENGINE_COPY 1
+#define ENGINE_FILL 2
+
+#define INDEXED_GATHER 1
+#define INDEXED_SCATTER 2
+#define INDEX_SEQ 0
+#define INDEX_RANDOM 1
+#define INDEX_CLUSTER 2
+static char *orderName[] = { "seq", "rand", "clust" };
+/* doubles that stay together in INDEX_CLUSTER */
+#define INDEX_RUN 16
+
+struct kernelDesc kernelTable[] = {
+	{"copy", 2, 2, 0, 0, SIMD_VARIANTS (copy)},	/* c = a */
+	{"scale", 2, 1, 2, 2, SIMD_VARIANTS (scale)},	/* b = s * c */
+	{"add", 3, 2, 0, 1, SIMD_VARIANTS (add)},	/* c = a + b */
+	{"triad", 3, 0, 1, 2, SIMD_VARIANTS (triad)},	/* a = b + s * c */
+	{"sum", 1, 0, 0, 0, SIMD_VARIANTS (sum)},	/* sum of a */
+	{"fill", 1, 2, 0, 0, SIMD_VARIANTS (fill)},	/* c = s */
+	{"rmw", 2, 1, 1, 1, SIMD_VARIANTS (rmw)},	/* b = b + s */
+	/* copy engines, c = a */
+	{"memcpy", 2, 2, 0, 0, ANY_ISA (memcpy_scalar),.engine = ENGINE_COPY},
+	{"movsb", 2, 2, 0, 0, ANY_ISA (movsb_scalar),.engine = ENGINE_COPY},
+	{"vcopy", 2, 2, 0, 0, ENGINE_VARIANTS (vcopy, copy),.engine = ENGINE_COPY},
+	{"ntcopy", 2, 2, 0, 0, ENGINE_VARIANTS (ntcopy, copy),
+	 .engine = ENGINE_COPY},
+	/* fill engines, c = 0 */
+	{"memset", 1, 2, 0, 0, ANY_ISA (memset_scalar),.engine = ENGINE_FILL},
+	{"stosb", 1, 2, 0, 0, ANY_ISA (stosb_scalar),.engine = ENGINE_FILL},
+	{"vfill", 1, 2, 0, 0, ENGINE_VARIANTS (vfill, fill),.engine = ENGINE_FILL},
+	{"ntfill", 1, 2, 0, 0, ENGINE_VARIANTS (ntfill, fill),
+	 .engine = ENGINE_FILL},
+};
+
+#define KERNELS (int) (sizeof (kernelTable) / sizeof (kernelTable[0]))
+static mix_fn mixTable[ISA_COUNT] = SIMD_VARIANTS (mix);
+/* sum for the --isa picked, unit stride runs it, set by select_isa () */
+kernel_fn sumKernel;
+
+/* kernels to run in bandwidth mode, copies of kernelTable rows or mixes */
+struct kernelDesc kernelList[BENCHMARKS];
+
+/* the read:write ratios --mix runs without a list */
+#define MIX_DEFAULT "1:0,3:1,2:1,1:1,1:2,0:1"
+/* strides in doubles --strides runs without a list, up to 2 pages */
+#define STRIDE_DEFAULT "1,2,4,8,16,32,64,128,256,512,1024"
+#define GATHER_DEFAULT \
+	"gather:seq,gather:rand,gather:clust,scatter:seq,scatter:rand,scatter:clust"
+#define ENGINES_DEFAULT "memcpy,movsb,vcopy,ntcopy,memset,stosb,vfill,ntfill"
+
+/* append a kernel name, or mix:R:W, to kernelList */
+void
+add_kernel (char *tok)
+{
+	struct kernelDesc *kd = &kernelList[numKernels];
+	int k, r, w;
+
+	if (numKernels == BENCHMARKS)
+	{
+		printf ("Sorry, at most %d kernels per run\n", BENCHMARKS);
+		exit (-1);
+	}
+	if (strncmp (tok, "mix:", 4) == 0)
+	{
+		if (sscanf (tok + 4, "%d:%d", &r, &w) != 2 || r < 0 || w < 0
+			 || r + w < 1)
+		{
+			printf ("Bad mix %s, want mix:<reads>:<writes>\n", tok);
+			exit (-1);
+		}
+		memset (kd, 0, sizeof (*kd));
+		kd->name = malloc (32);
+		snprintf (kd->name, 32, "mix:%d:%d", r, w);
+		/* every line of all three arrays is either read or written */
+		kd->arrays = 3;
+		kd->reads = r;
+		kd->writes = w;
+		numKernels++;
+		return;
+	}
+	if (strncmp (tok, "stride:", 7) == 0)
+	{
+		if (sscanf (tok + 7, "%d", &r) != 1 || r < 1)
+		{
+			printf ("Bad stride %s, want stride:<doubles>\n", tok);
+			exit (-1);
+		}
+		memset (kd, 0, sizeof (*kd));
+		kd->name = malloc (32);
+		snprintf (kd->name, 32, "stride:%d", r);
+		kd->arrays = 3;
+		kd->stride = r;
+		numKernels++;
+		return;
+	}
+	if (strncmp (tok, "gather:", 7) == 0 || strncmp (tok, "scatter:", 8) == 0)
+	{
+		char *order = strchr (tok, ':') + 1;
+		memset (kd, 0, sizeof (*kd));
+		kd->indexed = tok[0] == 'g' ? INDEXED_GATHER : INDEXED_SCATTER;
+		for (k = INDEX_CLUSTER; k >= 0; k--)
+			if (strcmp (order, orderName[k]) == 0)
+				break;
+		if (k < 0)
+		{
+			printf ("Bad %s, the index order is seq, rand or clust\n", tok);
+			exit (-1);
+		}
+		kd->order = k;
+		kd->name = strdup (tok);
+		kd->arrays = 2;
+		numKernels++;
+		return;
+	}
+	for (k = 0; k < KERNELS; k++)
+	{
+		if (strcmp (tok, kernelTable[k].name) == 0)
+			break;
+	}
+	if (k == KERNELS)
+	{
+		printf ("Unknown kernel %s, pick from:", tok);
+		for (k = 0; k < KERNELS; k++)
+			printf (" %s", kernelTable[k].name);
+		printf (" mix:R:W stride:N gather:order scatter:order\n");
+		exit (-1);
+	}
+	*kd = kernelTable[k];
+	numKernels++;
+}
+
+/* parse a comma separated list of kernel names into kernelList */
+void
+parse_kernels (char *list)
+{
+	char *tok, *save = NULL;
+
+	numKernels = 0;
+	engines = 0;
+	for (tok = strtok_r (list, ",", &save); tok != NULL;
+		  tok = strtok_r (NULL, ",", &save))
+		add_kernel (tok);
+}
+
+/* --mix and --strides: one kind: kernel per entry of a comma separated
+   list */
+void
+parse_sweep (char *kind, char *list)
+{
+	char *tok, *save = NULL, buf[64];
+
+	numKernels = 0;
+	engines = 0;
+	list = strdup (list);
+	for (tok = strtok_r (list, ",", &save); tok != NULL;
+		  tok = strtok_r (NULL, ",", &save))
+	{
+		snprintf (buf, sizeof (buf), "%s:%s", kind, tok);
+		add_kernel (buf);
+	}
+	free (list);
+}
+
+/* The name of an engine listed before kd in kernelTable that runs the
+   very same function for the --isa picked, or NULL.  movsb and stosb are
+   libc off x86, and the scalar ntcopy and ntfill are plain stores. */
+char *
+engine_alias (struct kernelDesc *kd)
+{
+	int k;
+
+	for (k = 0; k < KERNELS && strcmp (kernelTable[k].name, kd->name); k++)
+	{
+		if (kernelTable[k].engine && kernelTable[k].fn[isa] == kd->fn[isa])
+			return kernelTable[k].name;
 	}
-#if DEBUG
-	printf ("freed %d\n", id);
-#endif
-	pthread_exit (NULL);
 	return NULL;
 }
 
+/* --engines: every engine that is not an alias of another one */
+void
+add_engines ()
+{
+	int k;
+
+	for (k = 0; k < KERNELS; k++)
+	{
+		if (kernelTable[k].engine && engine_alias (&kernelTable[k]) == NULL)
+			add_kernel (kernelTable[k].name);
+	}
+}
+
+/* engines picked by --kernels that are aliases are named name=alias and
+   stay out of the crossovers */
+void
+mark_aliases ()
+{
+	char *alias, *name;
+	int k;
+
+	for (k = 0; k < numKernels; k++)
+	{
+		if (!kernelList[k].engine
+			 || (alias = engine_alias (&kernelList[k])) == NULL)
+			continue;
+		name = malloc (64);
+		snprintf (name, 64, "%s=%s", kernelList[k].name, alias);
+		kernelList[k].name = name;
+		kernelList[k].engine = 0;
+	}
+}
+
+/* reads MIX_UNIT pieces of d summed, then writes MIX_UNIT pieces
+   filled, and so on to the end */
+static inline double
+mix_kernel (struct kernelDesc *kd, double *d, double s, int64_t n)
+{
+	return mixTable[isa] (d, n, kd->reads, kd->writes, s);
+}
+
+/* every stride'th double, four sums in flight */
+double
+stride_kernel (double *x, int64_t n, int64_t stride)
+{
+	double t0 = 0.0, t1 = 0.0, t2 = 0.0, t3 = 0.0;
+	int64_t i;
+
+	for (i = 0; i + 3 * stride < n; i += 4 * stride)
+	{
+		t0 += x[i];
+		t1 += x[i + stride];
+		t2 += x[i + 2 * stride];
+		t3 += x[i + 3 * stride];
+	}
+	for (; i < n; i += stride)
+		t0 += x[i];
+	return t0 + t1 + t2 + t3;
+}
+
+void
+gather_kernel (double *d, double *x, int64_t * idx, int64_t n)
+{
+	int64_t i;
+
+	for (i = 0; i < n; i++)
+		d[i] = x[idx[i]];
+}
+
+void
+scatter_kernel (double *d, double *x, int64_t * idx, int64_t n)
+{
+	int64_t i;
+
+	for (i = 0; i < n; i++)
+		d[idx[i]] = x[i];
+}
+
+/* Fill idx with a permutation of every span doubles, each one only
+   pointing inside its own span so the kernels can run on pieces.
+   INDEX_CLUSTER shuffles runs of INDEX_RUN and keeps each run in order. */
+void
+build_index (int64_t * idx, int64_t n, int64_t span, int order,
+				 uint64_t * rng)
+{
+	int64_t lo, len, i, j, t, run;
+
+	for (i = 0; i < n; i++)
+		idx[i] = i % span;
+	if (order == INDEX_SEQ)
+		return;
+	run = order == INDEX_CLUSTER ? INDEX_RUN : 1;
+	for (lo = 0; lo < n; lo += span)
+	{
+		len = n - lo < span ? n - lo : span;
+		/* Fisher-Yates over the whole runs, a short last run stays put */
+		for (i = len / run - 1; i > 0; i--)
+		{
+			j = rng_below (rng, i + 1);
+			for (t = 0; t < run; t++)
+			{
+				int64_t v = idx[lo + i * run + t];
+				idx[lo + i * run + t] = idx[lo + j * run + t];
+				idx[lo + j * run + t] = v;
+			}
+		}
+	}
+}
+
+/* Useful bytes and cache lines touched by one pass of kd over arrays of
+   n doubles.  Gather and scatter count 8 bytes per element moved and
+   the index, the sequential side and every line a random index lands
+   on as lines. */
+void
+kernel_traffic (struct kernelDesc *kd, int64_t n, double *bytes,
+					 double *lines)
+{
+	double perLine = (double) cacheLineSize / sizeof (double);
+	double elements;
+
+	if (kd->stride > 1)
+	{
+		elements = (double) ((n + kd->stride - 1) / kd->stride) * 3;
+		*bytes = elements * sizeof (double);
+		*lines = kd->stride >= perLine ? elements : 3 * n / perLine;
+	}
+	else if (kd->indexed)
+	{
+		*bytes = (double) n * sizeof (double);
+		*lines = 2 * n / perLine + (kd->order == INDEX_RANDOM ? n : n / perLine);
+	}
+	else
+	{
+		*bytes = (double) n * sizeof (double) * kd->arrays;
+		*lines = *bytes / cacheLineSize;
+	}
+}
+
+/* one pass of kd over n doubles from off of the arrays */
+static inline double
+run_kernel (struct kernelDesc *kd, double **ar, int64_t off, double s,
+				int64_t n)
+{
+	double t = 0.0;
+	int j;
+
+	if (kd->indexed == INDEXED_GATHER)
+		gather_kernel (ar[0] + off, ar[1] + off, (int64_t *) ar[2] + off, n);
+	else if (kd->indexed == INDEXED_SCATTER)
+		scatter_kernel (ar[0] + off, ar[1] + off, (int64_t *) ar[2] + off, n);
+	else if (kd->stride == 1)
+	{
+		/* unit stride is what the vector sum is for */
+		for (j = 0; j < 3; j++)
+			t += sumKernel (ar[j], ar[j] + off, ar[j], s, n);
+	}
+	else if (kd->stride)
+	{
+		for (j = 0; j < 3; j++)
+			t += stride_kernel (ar[j] + off, n, kd->stride);
+	}
+	else if (kd->reads + kd->writes == 0)
+		return kd->fn[isa] (ar[kd->d] + off, ar[kd->x] + off, ar[kd->y] + off,
+								  s, n);
+	else
+	{
+		for (j = 0; j < 3; j++)
+			t += mix_kernel (kd, ar[j] + off, s, n);
+	}
+	return t;
+}
+
+int
+isa_supported (int which)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init ();
+	switch (which)
+	{
+	case ISA_SSE2:
+		return __builtin_cpu_supports ("sse2");
+	case ISA_AVX2:
+		return __builtin_cpu_supports ("avx2");
+	case ISA_AVX512:
+		return __builtin_cpu_supports ("avx512f");
+	}
+#endif
+	return which == ISA_SCALAR;
+}
+
+/* pick the widest kernels this CPU runs, or check the one asked for */
+void
+select_isa ()
+{
+	int i;
+
+	if (isa >= 0)
+	{
+		if (!isa_supported (isa))
+		{
+			printf ("Sorry, this CPU does not support %s kernels\n",
+					  isaName[isa]);
+			exit (-1);
+		}
+	}
+	else
+	{
+		for (i = ISA_COUNT - 1; i >= 0; i--)
+		{
+			if (isa_supported (i))
+			{
+				isa = i;
+				break;
+			}
+		}
+	}
+	/* plain C loops can't promise streaming stores */
+	if (isa == ISA_SCALAR)
+		ntStores = 0;
+	for (i = 0; i < KERNELS; i++)
+	{
+		if (strcmp (kernelTable[i].name, "sum") == 0)
+			sumKernel = kernelTable[i].fn[isa];
+	}
+}
 
-double bandwidthAr[MAX_THREADS][MAX_ITER][BENCHMARKS];
+/* numRows rows of numSteps thread counts of numColumns results */
+double *bandwidthAr = NULL;
+#define RESULT(row, step) \
+	(bandwidthAr + ((size_t) (row) * numSteps + (step)) * numColumns)
 
 #ifdef DEBUG
 void
@@ -413,23 +1876,113 @@ printTimeAr ()
 	printf ("\n");
 } */
 
+/* Result rows, largest array first.  The fixed sweep creates them all
+   up front, --adaptive inserts them as it bisects. */
+int64_t *rowSize = NULL;
+int numRows = 0, rowCap = 0;
+char *measuredAr = NULL;		  /* [row * numSteps + step] */
+
+/* row for array_size, inserted in size order if it's new, -1 if there
+   is no memory for it */
+int
+find_row (int64_t array_size)
+{
+	size_t width = (size_t) numSteps * numColumns;
+	int r;
+
+	for (r = 0; r < numRows && rowSize[r] > array_size; r++);
+	if (r < numRows && rowSize[r] == array_size)
+		return r;
+	if (numRows == rowCap)
+	{
+		int cap = rowCap ? rowCap * 2 : 64;
+		double *band = realloc (bandwidthAr, cap * width * sizeof (double));
+		char *meas = realloc (measuredAr, (size_t) cap * numSteps);
+		int64_t *size = realloc (rowSize, cap * sizeof (int64_t));
+
+		if (band)
+			bandwidthAr = band;
+		if (meas)
+			measuredAr = meas;
+		if (size)
+			rowSize = size;
+		if (band == NULL || meas == NULL || size == NULL)
+		{
+			printf ("Warning no memory for result row %d\n", numRows);
+			return -1;
+		}
+		rowCap = cap;
+	}
+	memmove (RESULT (r + 1, 0), RESULT (r, 0),
+				(numRows - r) * width * sizeof (double));
+	memset (RESULT (r, 0), 0, width * sizeof (double));
+	memmove (&measuredAr[(r + 1) * numSteps], &measuredAr[r * numSteps],
+				(size_t) (numRows - r) * numSteps);
+	memset (&measuredAr[r * numSteps], 0, numSteps);
+	memmove (&rowSize[r + 1], &rowSize[r], (numRows - r) * sizeof (rowSize[r]));
+	rowSize[r] = array_size;
+	numRows++;
+	return r;
+}
+
+/* the rows of the fixed sweep */
+void
+init_rows ()
+{
+	int64_t array_size = maxMemory;
+
+	while (array_size >= minMemory && find_row (array_size) >= 0)
+		array_size = array_size * increaseArray;
+}
+
+/* per thread count, the sizes at which the fastest copy and the fastest
+   fill engine changes, smallest size first.  A new engine has to beat the
+   last one by CROSSOVER_MARGIN so noise between near equals is not
+   reported as a crossover. */
+#define CROSSOVER_MARGIN 0.05
 void
-zero_bandwidth (struct idThreadParams id)
+print_crossovers (FILE *fp, char *prefix)
 {
-	int i, array_size, num_array;
-	array_size = maxMemory / sizeof (double);	/* in KB, start small */
-	num_array = 0;
-	while (array_size >= minMemory / sizeof (double))
+	static char *groupName[] = { "", "copy", "fill" };
+	int group, step, row, i, best, last;
+	double *res;
+
+	for (step = 0; step < numSteps; step++)
 	{
-		for (cur_threads = 0; cur_threads < id.maxThreads; cur_threads++)
+		for (group = ENGINE_COPY; group <= ENGINE_FILL; group++)
 		{
-			for (i = 0; i < BENCHMARKS; i++)
+			last = -1;
+			for (row = numRows - 1; row >= 0; row--)
 			{
-				bandwidthAr[cur_threads][num_array][i] = 0;
+				if (!measuredAr[row * numSteps + step])
+					continue;
+				res = RESULT (row, step);
+				best = -1;
+				for (i = 0; i < numKernels; i++)
+				{
+					if (kernelList[i].engine != group)
+						continue;
+					if (best < 0 || res[i * (lineColumns + 1)] >
+						 res[best * (lineColumns + 1)])
+						best = i;
+				}
+				if (best < 0)
+					break;
+				if (best == last)
+					continue;
+				if (last >= 0 && res[best * (lineColumns + 1)] <
+					 (1.0 + CROSSOVER_MARGIN) * res[last * (lineColumns + 1)])
+					continue;
+				if (last < 0)
+					fprintf (fp, "%scrossover threads=%d %s:", prefix,
+								schedule[step], groupName[group]);
+				fprintf (fp, "%s %s from %.2fKB", last < 0 ? "" : ",",
+							kernelList[best].name, rowSize[row] / 1024.0);
+				last = best;
 			}
+			if (last >= 0)
+				fprintf (fp, "\n");
 		}
-		array_size = array_size * increaseArray;
-		num_array++;
 	}
 }
 
@@ -438,13 +1991,12 @@ print_bandwidth (char *str, struct idThreadParams id)
 {
 	FILE *fp;
 
-	int i, array_size, num_array;
-	array_size = maxMemory / sizeof (double);	/* in KB, start small */
-	num_array = 0;
+	int i, row, step;
+
 	fp = fopen (str, "w");
 	fprintf
 		(fp,
-		 "#minMemory=%d maxMemory=%" PRIu64
+		 "#minMemory=%" PRId64 " maxMemory=%" PRIu64
 		 " minThreads=%d maxThreads=%d writing to %s band=%d lat=%d\n",
 		 minMemory, maxMemory, id.minThreads, id.maxThreads, str, band, lat);
 	fprintf (fp,
@@ -452,22 +2004,50 @@ print_bandwidth (char *str, struct idThreadParams id)
 				" cacheLineSize=%d\n", increaseArray, timeStep, cacheSize,
 				cacheLineSize);
 	fprintf (fp, "#affinity=%d affinity_wide=%d\n", affinity, affinity_wide);
-	fprintf (fp, "#numPages=%d\n", numPages);
+	fprintf (fp, "#placement=%s", placeName[placement]);
+	for (i = 0; i < placeCount && i < id.maxThreads; i++)
+		fprintf (fp, "%s%d", i ? "," : " order=", placeOrder[i]);
+	fprintf (fp, "\n");
+	fprintf (fp, "#trials=%d tolerance=%f maxTrials=%d timer=%s\n", trials,
+				tolerance, maxTrials, PSTREAM_CLOCK_NAME);
+	fprintf (fp, "#pages=%s effective=%s\n", pagesName[pages],
+				pagesName[pagesGot < 0 ? pages : pagesGot]);
+	fprintf (fp, "#counters=");
+	for (i = 0; i < numCounters && useCounters; i++)
+		fprintf (fp, "%s%s", i ? "," : "", counterTable[i].name);
+	fprintf (fp, "%s\n", useCounters ? "" : "none");
+	fprintf (fp, "#numPages=%d mlp=%d seed=%" PRIu64 "\n", numPages, mlpMax,
+				seed);
+	fprintf (fp, "#isa=%s ntStores=%d\n", isaName[isa], ntStores);
+	fprintf (fp, "#adaptive=%d resolution=%f threshold=%f budget=%f\n",
+				adaptive, adaptResolution, adaptThreshold, adaptBudget);
+	fprintf (fp, "#threads=");
+	for (step = 0; step < numSteps; step++)
+		fprintf (fp, "%s%d", step ? "," : "", schedule[step]);
+	fprintf (fp, "\n");
+	fprintf (fp, "#barrier=%s spinTimeout=%f skewUs=", barrierName[barrierKind],
+				spinTimeout);
+	for (step = 0; step < numSteps; step++)
+		fprintf (fp, "%s%.2f", step ? "," : "", releaseSkew[step]);
+	fprintf (fp, "\n");
+	fprintf (fp, "#columns=");
+	for (i = 0; i < numColumns; i++)
+		fprintf (fp, "%s%s", i ? "," : "", columns[i].name);
+	fprintf (fp, " per thread count\n");
 
-	while (array_size >= minMemory / sizeof (double))
+	for (row = 0; row < numRows; row++)
 	{
-		fprintf (fp, "ar= %8.2f ", array_size / 128.0);
-		for (cur_threads = 0; cur_threads <= logint (id.maxThreads); cur_threads++)
+		fprintf (fp, "ar= %8.2f ", rowSize[row] / 1024.0);
+		for (step = 0; step < numSteps; step++)
 		{
-			for (i = 0; i < BENCHMARKS; i++)
+			for (i = 0; i < numColumns; i++)
 			{
-				fprintf (fp, "%7.2f ", bandwidthAr[cur_threads][num_array][i]);
+				fprintf (fp, "%7.2f ", RESULT (row, step)[i]);
 			}
 		}
 		fprintf (fp, "\n");
-		array_size = array_size * increaseArray;
-		num_array++;
 	}
+	print_crossovers (fp, "#");
 	fclose (fp);
 }
 
@@ -476,23 +2056,29 @@ bandwidth_time (double *times, double *results, int64_t maxmem, long long scale,
 					 int cur_threads)
 {
 	int i;
-	double bandwidth;
-	printf ("diff=%8.7f ", times[0]);
-	for (i = 0; i < 2; i++)
+	double bandwidth, bytes, lines;
+	struct kernelDesc *kd;
+
+	for (i = 0; i < numKernels; i++)
 	{
-		bandwidth = ((maxmem / 1024.0) * cur_threads * scale) / times[i];
+		kd = &kernelList[i];
+		/* each of the 3 arrays gets a third of maxmem */
+		kernel_traffic (kd, (maxmem / sizeof (double)) / 3, &bytes, &lines);
+		bandwidth = ((bytes / 1024.0) * cur_threads * scale) / times[i];
 		bandwidth = bandwidth / 1024.0;	/* convert KB to MB. */
-		if (i == 0)
-			printf ("add = %6.2f MB/sec ", bandwidth);
-		if (i == 1)
-			printf ("triad = %6.2f MB/sec", bandwidth);
-		results[i] = bandwidth;
+		if (lineColumns)
+		{
+			results[i * 2] = bandwidth;
+			results[i * 2 + 1] = lines * cur_threads * scale / times[i] / 1.0e6;
+		}
+		else
+			results[i] = bandwidth;
 	}
 }
 
 
 void
-latency_time (double *times, double *results, int64_t maxmem, int scale,
+latency_time (double *times, double *results, int64_t maxmem, long long scale,
 				  int cur_threads)
 {
 	int64_t hops;
@@ -503,120 +2089,191 @@ latency_time (double *times, double *results, int64_t maxmem, int scale,
 	hops = (maxmem / cacheLineSize) - 1;
 	lat = 1.0e+9 * diff / (hops * cur_threads);
 	lat = lat / scale;
-	avgLat = 1.0e+9 * diff / hops / (int) scale;
-	printf (" diff=%4.3f lat = %f avgLat = %f hops=%"PRIu64"", diff, lat,
-			  avgLat, hops);
+	avgLat = 1.0e+9 * diff / hops / (double) scale;
 	results[0] = lat;
 	results[1] = avgLat;
 }
 
-void *
-stream_thread (void *arg)
+/* effective latency per load and lines per second for each K */
+void
+mlp_time (double *times, double *results, int64_t maxmem, long long scale,
+			 int cur_threads)
 {
-	int i, j,pieces,offset;
-	double *a, *b, *c;
-	double *aa = NULL, *bb = NULL, *cc = NULL;
-	int size;
-	double scalar;
-	struct idThreadParams *id = arg;
-#ifdef VERBOSE
-	printf ("id=%d maxThreads=%d\n",id->id, id->maxThreads);
-#endif
+	int64_t lines, loads;
+	int k;
+	double lat, rate;
 
-#ifdef USEAFFINITY
-	if (affinity)
-		set_affinity (id);
-#endif
-	size = (maxmem / sizeof (double)) / 3;
-	if (usenuma)
+	lines = maxmem / cacheLineSize;
+	for (k = 0; k < numSlots; k++)
 	{
-#ifdef USENUMA
-		if (!affinity) { // use numa affinity binding 
-			pid_t pid=getpid();
-			int aid=id->id;
-			if (affinity_wide && spread>1) {
-				aid=((aid%spread) * max_cpu/spread) + aid/spread;
-			}
-			struct bitmask *pBM=numa_bitmask_alloc(numa_num_configured_cpus());
-			pBM=numa_bitmask_clearall(pBM);
-			pBM=numa_bitmask_setbit(pBM, aid);
-			numa_sched_setaffinity(pid,pBM);
-		}
-	//numa_run_on_node (id->id % CPUS);
-#endif
-		/* split the cache into thirds, and insure that each array maps
-		   into it's 3rd.  Helps quite a bit on shanhai. */
-#ifdef USENUMA
-//		printf ("on cpu %d freeing %d\n",id->id);
-		aa =
-			(double *) numa_alloc_local (size * sizeof (double) + 2 * cacheSize +
-			2 * cacheLineSize);
-		bb =
-			(double *) numa_alloc_local (size * sizeof (double) + 2 * cacheSize +
-			2 * cacheLineSize);
-		cc =
-			(double *) numa_alloc_local (size * sizeof (double) + 2 * cacheSize +
-			2 * cacheLineSize);
-#endif
+		loads = (lines / (1 << k)) * (1 << k);
+		lat = 1.0e+9 * times[k] / ((double) loads * scale);
+		rate = (double) loads *scale * cur_threads / times[k] / 1.0e+6;
+		results[k * 2] = lat;
+		results[k * 2 + 1] = rate;
 	}
-	else
+}
+
+/* carve the three stream arrays out of a worker's arena, each aligned
+   with its 1/3rd of the cache (or its share of a shared cache) */
+void
+stream_arrays (struct idThreadParams *id, double **a, double **b, double **c)
+{
+	struct threadArena *ar = &pool.arena[id->id];
+	int pieces, offset;
+
+	if (shared_cache)
 	{
-		aa = (double *) malloc (size * sizeof (double) + 2 * cacheSize +
-									 2 * cacheLineSize);
-		bb = (double *) malloc (size * sizeof (double) + 2 * cacheSize +
-									 2 * cacheLineSize);
-		cc = (double *) malloc (size * sizeof (double) + 2 * cacheSize +
-									 2 * cacheLineSize);
+		/* devide shared cache into piece for each thread */
+		pieces = id->maxThreads * 3;
+		offset = id->id * 3;
 	}
-	if ((aa == NULL) || (bb == NULL) || (cc == NULL))
+	else
 	{
-		printf ("allocation of array of %d doubles failes\n", size);
-		printf ("aa=%p bb=%p cc=%p\n", (void *) aa, (void *) bb, (void *) cc);
-		exit (-1);
+		/* assume each thread get's it's own cache */
+		pieces = 3;
+		offset = 0;
 	}
-	/* align each pointer with their 1/3rd of the cache */
+	*a = (double *) align_pointer ((int64_t *) ar->base, cacheSize,
+											 cacheLineSize, pieces, offset + 0);
+	*b = (double *) align_pointer ((int64_t *) (ar->base + ar->slice),
+											 cacheSize, cacheLineSize, pieces, offset + 1);
+	*c = (double *) align_pointer ((int64_t *) (ar->base + 2 * ar->slice),
+											 cacheSize, cacheLineSize, pieces, offset + 2);
+}
 
-// need to change 12 to maxthreads * 3
-// 12 is perfect for 4 threads.
-	if (shared_cache)
+/* Allocate len bytes with the page size asked for, rounding len up to
+   it, passing extra mmap flags along.  Huge page reservations that fail
+   fall back to 4k pages, which is reported once and left in *got.  With
+   MAP_POPULATE the pages are in before the THP madvise gets a say, so
+   only hugetlb kinds should ask for it. */
+void *
+page_alloc (int64_t * len, int want, int *got, int extra)
+{
+	static int warned = 0;
+	void *p = NULL;
+	int flags = MAP_ANONYMOUS | MAP_PRIVATE | extra;
+
+	*got = want;
+	if (want == PAGES_2M || want == PAGES_1G)
 	{
-		/* devide shared cache into piece for each thread */
-		pieces=id->maxThreads*3;
-		offset=id->id*3;
-	} else {
-		/* assume each thread get's it's own cache */
-		pieces=3;
-		offset=0;
-	}	
-//	printf ("pieces = %d offset=%d cachesize=%d\n",pieces,offset,cacheSize);
-	a = (double *) align_pointer ((int64_t *) aa, cacheSize, cacheLineSize, 
-				pieces,offset+0);
-	b = (double *) align_pointer ((int64_t *) bb, cacheSize, cacheLineSize, 
-				pieces,offset+1);
-	c = (double *) align_pointer ((int64_t *) cc, cacheSize, cacheLineSize, 
-				pieces,offset+2);
-/*
-	a=(double *) aa;
-	b=(double *) bb;
-	c=(double *) cc;
-*/
+		int64_t huge = want == PAGES_2M ? 2097152 : 1073741824;
+		int64_t hlen = (*len + huge - 1) & ~(huge - 1);
+		flags |= MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+		flags |= (want == PAGES_2M ? 21 : 30) << MAP_HUGE_SHIFT;
+#endif
+		p = mmap (0, hlen, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			*len = hlen;
+			return p;
+		}
+		if (__sync_bool_compare_and_swap (&warned, 0, 1))
+			printf ("Warning %s page reservation of %" PRIu64
+					  " MB failed (%s), %s\n",
+					  pagesName[want], hlen / (1024 * 1024), strerror (errno),
+					  firstTouch ? "its first-touch columns read 0"
+					  : "falling back to 4k pages");
+		*got = PAGES_4K;
+		flags = MAP_ANONYMOUS | MAP_PRIVATE | extra;
+	}
+	p = mmap (0, *len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (want == PAGES_THP)
+		madvise (p, *len, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_NOHUGEPAGE
+	/* keep 4k runs honest when THP is set to always */
+	if (want == PAGES_4K)
+		madvise (p, *len, MADV_NOHUGEPAGE);
+#endif
+	return p;
+}
+
+void
+page_free (void *p, int64_t len)
+{
+	munmap (p, len);
+}
 
-/*   printf ("a=%p acs=%p acls=%ld ps=%lL2=%" PRIu64 "\n",
-           (void *) a, (long int) a % cacheSize, (lui) a % cacheLineSize,
-           cacheSize);
-   printf ("b=%p bcs=%p bcls=%ld L2=%" PRIu64 "\n",
-           (void *) b, (long int) b % cacheSize, (lui) b % cacheLineSize,
-           cacheSize);
-   printf ("c=%p ccs=%p ccls=%ld L2=%" PRIu64 "\n",
-           (void *) c, (long int) c % cacheSize, (lui) c % cacheLineSize,
-           cacheSize); */
+/* allocate the arena from the pinned owner so NUMA first touch places
+   it locally, then fault in the part the benchmarks will use */
+void
+arena_alloc (struct idThreadParams *id, int64_t maxmem)
+{
+	struct threadArena *ar = &pool.arena[id->id];
+	double *a, *b, *c;
+	int64_t bytes;
 
-	if ((a == NULL) || (b == NULL) || (c == NULL))
+	ar->slice = maxmem / 3 + 2 * cacheSize + 2 * cacheLineSize;
+	ar->slice = (ar->slice + cacheLineSize - 1) & ~(int64_t) (cacheLineSize - 1);
+	/* the latency chain needs no cache colouring slack */
+	ar->len = lat ? maxmem : 3 * ar->slice;
+	ar->base = page_alloc (&ar->len, pages, &ar->pages, 0);
+	ar->chain = 0;
+	if (ar->base == NULL)
 	{
-		printf ("allocation of array of %d doubles failed\n", size);
-		printf ("a=%p b=%p c=%p\n", (void *) a, (void *) b, (void *) c);
+		printf ("Warning memory allocation of %" PRIu64 " MB arena failed\n",
+				  ar->len / (1024 * 1024));
 		exit (-1);
 	}
+#ifdef USENUMA
+	if (pool.memNode >= 0)
+		numa_tonode_memory (ar->base, ar->len, pool.memNode);
+	else if (usenuma)
+		numa_setlocal_memory (ar->base, ar->len);
+#endif
+	pthread_mutex_lock (&pool.lock);
+	if (pagesGot < 0 || ar->pages < pagesGot)
+		pagesGot = ar->pages;
+	pthread_mutex_unlock (&pool.lock);
+	if (lat)
+	{
+		memset (ar->base, 0, maxmem);
+	}
+	else
+	{
+		bytes = (maxmem / sizeof (double)) / 3 * sizeof (double);
+		stream_arrays (id, &a, &b, &c);
+		memset (a, 0, bytes);
+		memset (b, 0, bytes);
+		memset (c, 0, bytes);
+	}
+}
+
+void
+arena_free (struct idThreadParams *id)
+{
+	struct threadArena *ar = &pool.arena[id->id];
+
+	page_free (ar->base, ar->len);
+	ar->base = NULL;
+}
+
+void *
+stream_thread (void *arg)
+{
+	int64_t i, j;
+	int k;
+	double *a, *b, *c;
+	double *ar[3];
+	int64_t size;
+	double scalar, sink = 0.0;
+	struct idThreadParams *id = arg;
+	struct kernelDesc *kd;
+	uint64_t rng = rng_seed (seed, id->id);
+#ifdef VERBOSE
+	printf ("id=%d maxThreads=%d\n",id->id, id->maxThreads);
+#endif
+
+	size = (pool.cmd.maxmem / sizeof (double)) / 3;
+	stream_arrays (id, &a, &b, &c);
+	ar[0] = a;
+	ar[1] = b;
+	ar[2] = c;
 
 /*the below seems like a good idea, but fails in many environments
   ret=posix_memalign (&a,64,size * sizeof (double));
@@ -629,192 +2286,2036 @@ stream_thread (void *arg)
 		c[i] = 0.0;
 	}
 	scalar = 0.5 * a[1];
+	for (k = 0; k < numKernels; k++)
+	{
+		kd = &kernelList[k];
+		if (kd->indexed)
+			build_index ((int64_t *) c, size, size, kd->order, &rng);
+		sync_thread (id->id, kd->name);
+		counters_start (id->id);
+		timeAr[id->id][k * 2] = second ();
+		for (j = 0; j < pool.cmd.scale; j++)
+		{
+			sink += run_kernel (kd, ar, 0, scalar, size);
+		}
+		timeAr[id->id][k * 2 + 1] = second ();
+		counters_stop (id->id, k);
+		/* index bits read as doubles are subnormals, which would slow
+		   every later kernel reading c down to microcode assists */
+		if (kd->indexed)
+			memset (c, 0, size * sizeof (double));
+	}
+	for (i = 0; i < size; i++)
+	{
+		if (c[i] == 3.14159)
+		{
+			printf ("foo\n");
+		}
+		if (b[i] == 3.14159)
+		{
+			printf ("foo\n");
+		}
+	}
+	if (sink == 3.14159)
+	{
+		printf ("foo\n");
+	}
+	/* Do not let a finished thread start the next command early. */
+	sync_thread (id->id, label[2]);
+	return NULL;
+}
+
+/* One point of --loaded.  The probes time their chains, the load workers
+   keep going until the last probe is done and note how much they moved
+   in how long. */
+void
+loaded_thread (struct idThreadParams *id)
+{
+	struct kernelDesc *kd = &kernelList[0];
+	int64_t *chain = (int64_t *) pool.arena[id->id].base;
+	int64_t i, off, n, size;
+	long long d;
+	double *a, *b, *c, *ar[3];
+	double scalar = 1.0, sink = 0.0, bytes = 0.0, chunk, lines;
+	uint64_t rng;
+
+	if (id->id < probes)
+	{
+		size = pool.cmd.maxmem / sizeof (int64_t);
+		/* same cycle as latency_thread (); load threads stay in their own arenas */
+		if (pool.arena[id->id].chain != size)
+		{
+			rng = rng_seed (seed, id->id);
+			build_cycle (chain, size, &rng);
+			pool.arena[id->id].chain = size;
+		}
+		sync_thread (id->id, label[0]);
+		timeAr[id->id][0] = second ();
+		follow_ar (chain, size, pool.cmd.scale);
+		timeAr[id->id][1] = second ();
+		__atomic_add_fetch (&probesDone, 1, __ATOMIC_RELEASE);
+		sync_thread (id->id, label[1]);
+		return;
+	}
+	size = (pool.cmd.maxmem / sizeof (double)) / 3;
+	stream_arrays (id, &a, &b, &c);
+	ar[0] = a;
+	ar[1] = b;
+	ar[2] = c;
+	for (i = 0; i < size; i++)
+	{
+		a[i] = 2.0;
+		b[i] = 0.5;
+		c[i] = 0.0;
+	}
+	rng = rng_seed (seed, id->id);
+	if (kd->indexed)
+		build_index ((int64_t *) c, size, LOAD_CHUNK, kd->order, &rng);
 	sync_thread (id->id, label[0]);
 	timeAr[id->id][0] = second ();
-	for (j = 0; j < scale; j++)
+	while (__atomic_load_n (&probesDone, __ATOMIC_ACQUIRE) < probes)
 	{
-		switch (j % 2)
+		if (loadDelay < 0)
 		{
-		case 0:
-			for (i = 0; i < size; i++)
+			cpu_relax ();
+			continue;
+		}
+		for (off = 0; off < size; off += LOAD_CHUNK)
+		{
+			n = size - off < LOAD_CHUNK ? size - off : LOAD_CHUNK;
+			sink += run_kernel (kd, ar, off, scalar, n);
+			kernel_traffic (kd, n, &chunk, &lines);
+			bytes += chunk;
+			for (d = 0; d < loadDelay; d++)
+				cpu_relax ();
+			if (__atomic_load_n (&probesDone, __ATOMIC_RELAXED) == probes)
+				break;
+		}
+	}
+	timeAr[id->id][1] = second ();
+	loadBytes[id->id] = bytes;
+	if (sink == 3.14159)
+	{
+		printf ("foo\n");
+	}
+	sync_thread (id->id, label[1]);
+}
+
+/* one timed region per op and place, scale ops each */
+void
+atomics_thread (struct idThreadParams *id)
+{
+	int64_t *w, v, sink = 0;
+	long long j;
+	int op, where, k;
+
+	for (op = ATOMIC_FAA; op <= ATOMIC_XCHG; op++)
+	{
+		for (where = ATOMIC_SHARED; where <= ATOMIC_PADDED; where++)
+		{
+			k = op * 3 + where;
+			if (where == ATOMIC_SHARED)
+				w = &atomicLines[0].w[0];
+			else if (where == ATOMIC_LINE)
+				w = &atomicGroups[id->id / 8].w[id->id % 8];
+			else
+				w = &atomicLines[id->id + 1].w[0];
+			sync_thread (id->id, label[0]);
+			counters_start (id->id);
+			timeAr[id->id][k * 2] = second ();
+			for (j = 0; j < pool.cmd.scale; j++)
 			{
-				c[i] = a[i] + b[i];
+				if (op == ATOMIC_FAA)
+					__atomic_fetch_add (w, 1, __ATOMIC_SEQ_CST);
+				else if (op == ATOMIC_CAS)
+				{
+					v = __atomic_load_n (w, __ATOMIC_RELAXED);
+					while (!__atomic_compare_exchange_n (w, &v, v + 1, 0,
+																	 __ATOMIC_SEQ_CST,
+																	 __ATOMIC_RELAXED));
+				}
+				else
+					sink += __atomic_exchange_n (w, j, __ATOMIC_SEQ_CST);
 			}
+			timeAr[id->id][k * 2 + 1] = second ();
+			counters_stop (id->id, k);
+		}
+	}
+	if (sink == 314159)
+	{
+		printf ("foo\n");
+	}
+	sync_thread (id->id, label[2]);
+}
+
+#ifdef USENUMA
+/* the next node after node that has memory and that this process may
+   allocate from, node itself when there is no other */
+int
+next_mem_node (int node)
+{
+	struct bitmask *mems = numa_get_mems_allowed ();
+	int nodes = numa_max_node () + 1;
+	int i, n = node;
+
+	for (i = 1; i < nodes; i++)
+	{
+		n = (node + i) % nodes;
+		if (numa_bitmask_isbitset (mems, n) && numa_node_size64 (n, NULL) > 0)
 			break;
-		case 1:
-			for (i = 0; i < size; i++)
+	}
+	numa_bitmask_free (mems);
+	return i < nodes ? n : node;
+}
+#endif
+
+/* One timed region per page kind and way of faulting in: map
+   cmd.maxmem bytes and fault all of it in, bound to this thread's node
+   or to the next one with memory.  The unmap waits for every thread so
+   it doesn't overlap anyone's faults. */
+void
+touch_thread (struct idThreadParams *id)
+{
+	int64_t len, i;
+	int kind, way, k, got, populate, locked;
+	char *p;
+#ifdef USENUMA
+	struct bitmask *mask = NULL;
+
+	if (touchPlaces > 1)
+	{
+		int node = numa_node_of_cpu (sched_getcpu ());
+
+		if (node < 0)
+			node = 0;
+		if (touchRemote)
+			node = next_mem_node (node);
+		mask = numa_allocate_nodemask ();
+		numa_bitmask_setbit (mask, node);
+		numa_set_membind (mask);
+	}
+#endif
+	for (kind = PAGES_4K; kind <= PAGES_1G; kind++)
+	{
+		for (way = TOUCH_WRITE; way <= TOUCH_MADVISE; way++)
+		{
+			k = kind * TOUCH_WAYS + way;
+			len = pool.cmd.maxmem;
+			sync_thread (id->id, label[0]);
+			timeAr[id->id][k * 2] = second ();
+			/* MAP_POPULATE would fault 4k and THP in before their madvise,
+			   mlock populates the same way once it has been applied */
+			populate = way == TOUCH_POPULATE
+				&& (kind == PAGES_2M || kind == PAGES_1G) ? MAP_POPULATE : 0;
+			p = page_alloc (&len, kind, &got, populate);
+			locked = 0;
+			if (p != NULL && way == TOUCH_POPULATE && !populate)
+			{
+				locked = mlock (p, len) == 0;
+				if (!locked)
+					touchFailed[k] = 1;
+			}
+			if (p != NULL && way == TOUCH_WRITE)
 			{
-				b[i] = a[i] + c[i];
+				for (i = 0; i < len; i += 4096)
+					p[i] = 1;
 			}
+			if (p != NULL && way == TOUCH_MADVISE
+				 && madvise (p, len, MADV_POPULATE_WRITE))
+				touchFailed[k] = 1;
+			timeAr[id->id][k * 2 + 1] = second ();
+			if (p == NULL || got != kind)
+				touchFailed[k] = 1;
+			else
+				__sync_fetch_and_add (&touchBytes[k], len);
+			sync_thread (id->id, label[1]);
+			if (locked)
+				munlock (p, len);
+			if (p != NULL)
+				page_free (p, len);
 		}
 	}
-	timeAr[id->id][1] = second ();
-	for (i = 0; i < size; i++)
+#ifdef USENUMA
+	if (mask != NULL)
 	{
-		if (c[i] == 3.14159)
+		numa_set_localalloc ();
+		numa_bitmask_free (mask);
+	}
+#endif
+	sync_thread (id->id, label[2]);
+}
+
+#ifdef USENUMA
+/* the cpus of node that this thread may run on (cpuset, taskset),
+   returns how many */
+int
+node_cpus (int node, struct bitmask *cpus)
+{
+	struct bitmask *allowed = numa_allocate_cpumask ();
+	unsigned int cpu;
+	int n = 0;
+
+	if (numa_node_to_cpus (node, cpus) < 0
+		 || numa_sched_getaffinity (0, allowed) < 0)
+		numa_bitmask_clearall (cpus);
+	for (cpu = 0; cpu < cpus->size; cpu++)
+	{
+		if (!numa_bitmask_isbitset (cpus, cpu))
+			continue;
+		if (numa_bitmask_isbitset (allowed, cpu))
+			n++;
+		else
+			numa_bitmask_clearbit (cpus, cpu);
+	}
+	numa_bitmask_free (allowed);
+	return n;
+}
+#endif
+
+/* pin a worker once, for the lifetime of the pool */
+void
+bind_worker (struct idThreadParams *id)
+{
+#ifdef USENUMA
+	if (pool.cpuNode >= 0)
+	{
+		/* pin to the id'th allowed cpu of the node */
+		struct bitmask *cpus = numa_allocate_cpumask ();
+		int cpu, n = 0, want, weight;
+
+		weight = node_cpus (pool.cpuNode, cpus);
+		if (weight == 0)
 		{
-			printf ("foo\n");
+			printf ("Warning no allowed cpu on node %d, thread %d not pinned\n",
+					  pool.cpuNode, id->id);
+			numa_bitmask_free (cpus);
+			return;
 		}
-		if (b[i] == 3.14159)
+		want = id->id % weight;
+		for (cpu = 0; cpu < (int) cpus->size; cpu++)
 		{
-			printf ("foo\n");
+			if (numa_bitmask_isbitset (cpus, cpu) && n++ == want)
+				break;
+		}
+		numa_bitmask_clearall (cpus);
+		numa_bitmask_setbit (cpus, cpu);
+		if (numa_sched_setaffinity (0, cpus) < 0)
+			printf ("Warning can't pin thread %d to cpu %d (%s)\n",
+					  id->id, cpu, strerror (errno));
+		numa_bitmask_free (cpus);
+		return;
+	}
+#endif
+#ifdef USEAFFINITY
+	if (affinity)
+		set_affinity (id);
+#endif
+#ifdef USENUMA
+	/* spread threads round robin over the nodes, not over threads */
+	if (usenuma && lat && !affinity)
+		numa_run_on_node (id->id % (numa_max_node () + 1));
+	if (usenuma && band && !affinity)
+	{									  /* use numa affinity binding */
+		pid_t pid = 0;				  /* this thread, not the whole process */
+		int aid = id->id;
+		if (affinity_wide && spread > 1)
+		{
+			aid = ((aid % spread) * max_cpu / spread) + aid / spread;
 		}
+		struct bitmask *pBM = numa_bitmask_alloc (numa_num_configured_cpus ());
+		pBM = numa_bitmask_clearall (pBM);
+		pBM = numa_bitmask_setbit (pBM, aid);
+		numa_sched_setaffinity (pid, pBM);
+		numa_bitmask_free (pBM);
+	}
+#endif
+}
+
+/* back to back barriers, noting when each thread got out of each */
+void
+barrier_thread (struct idThreadParams *id)
+{
+	int r;
+
+	for (r = 0; r < BARRIER_ROUNDS; r++)
+	{
+		sync_thread (id->id, label[0]);
+		releaseAr[r * cur_threads + id->id] = second ();
 	}
 	sync_thread (id->id, label[1]);
-	timeAr[id->id][2] = second ();
-	for (j = 0; j < scale; j++)
+}
+
+void *
+worker_thread (void *arg)
+{
+	struct idThreadParams *id = arg;
+	int seen = 0;
+	int op;
+
+	bind_worker (id);
+	arena_alloc (id, pool.maxmem);
+	counters_open (id);
+	while (1)
+	{
+		pthread_mutex_lock (&pool.lock);
+		while (pool.generation == seen)
+			pthread_cond_wait (&pool.go, &pool.lock);
+		seen = pool.generation;
+		op = pool.cmd.op;
+		pthread_mutex_unlock (&pool.lock);
+		if (op == CMD_QUIT)
+			break;
+		/* anything else may write over the latency cycle */
+		if (op != CMD_LATENCY && op != CMD_BARRIER && op != CMD_LOADED)
+			pool.arena[id->id].chain = 0;
+		if (op == CMD_STREAM)
+			stream_thread (id);
+		if (op == CMD_LATENCY)
+			latency_thread (id);
+		if (op == CMD_BARRIER)
+			barrier_thread (id);
+		if (op == CMD_LOADED)
+			loaded_thread (id);
+		if (op == CMD_ATOMICS)
+			atomics_thread (id);
+		if (op == CMD_TOUCH)
+			touch_thread (id);
+		threadCpu[id->id] = sched_getcpu ();
+		pthread_mutex_lock (&pool.lock);
+		pool.done++;
+		if (pool.done == pool.threads)
+			pthread_cond_signal (&pool.finished);
+		pthread_mutex_unlock (&pool.lock);
+	}
+	counters_close (id);
+	arena_free (id);
+	return NULL;
+}
+
+/* run one command on every worker and wait for all of them to finish */
+void
+pool_run (int op, int64_t maxmem, long long scale)
+{
+	pthread_mutex_lock (&pool.lock);
+	pool.cmd.op = op;
+	pool.cmd.maxmem = maxmem;
+	pool.cmd.scale = scale;
+	pool.done = 0;
+	pool.generation++;
+	pthread_cond_broadcast (&pool.go);
+	if (op != CMD_QUIT)
+	{
+		while (pool.done < pool.threads)
+			pthread_cond_wait (&pool.finished, &pool.lock);
+	}
+	pthread_mutex_unlock (&pool.lock);
+}
+
+void
+pool_start (int threads, int64_t maxmem)
+{
+	int i, ret;
+
+	pool.threads = threads;
+	pool.maxmem = maxmem;
+	pool.generation = 0;
+	/* spinning on more threads than cpus only burns the releaser's time */
+	if (barrierKind != BARRIER_BLOCK && numCpus > 0 && threads > numCpus)
+		barrier_setup (threads, BARRIER_BLOCK);
+	else
+		barrier_setup (threads, barrierKind);
+	for (i = 0; i < threads; i++)
 	{
-		switch (j % 2)
+		pool.tid[i].id = i;
+		pool.tid[i].maxThreads = threads;
+		ret = pthread_create (&pool.thread[i], NULL, worker_thread,
+									 &pool.tid[i]);
+		if (ret != 0)
 		{
-		case 0:
-			for (i = 0; i < size; i++)
+			printf ("ret=%d, pthread_create failed!!\n", ret);
+			exit (-1);
+		}
+	}
+}
+
+void
+pool_stop ()
+{
+	int i;
+
+	pool_run (CMD_QUIT, 0, 0);
+	for (i = 0; i < pool.threads; i++)
+	{
+		pthread_join (pool.thread[i], NULL);
+	}
+	pool.threads = 0;
+}
+
+/* per thread tables for up to threads workers */
+void
+alloc_tables (int threads)
+{
+	int i, j;
+
+	timeAr = calloc (threads, sizeof (timeAr[0]));
+	perfFd = malloc (threads * sizeof (perfFd[0]));
+	counterAr = calloc (threads, sizeof (counterAr[0]));
+	threadCpu = calloc (threads, sizeof (threadCpu[0]));
+	loadBytes = calloc (threads, sizeof (loadBytes[0]));
+	releaseAr = calloc ((size_t) threads * BARRIER_ROUNDS, sizeof (double));
+	/* a tree of threads leaves has fewer than threads inner nodes */
+	if (posix_memalign ((void **) &barrierTree, 64,
+							  2 * (threads + 1) * sizeof (barrierTree[0])))
+		barrierTree = NULL;
+	pool.thread = calloc (threads, sizeof (pool.thread[0]));
+	pool.tid = calloc (threads, sizeof (pool.tid[0]));
+	pool.arena = calloc (threads, sizeof (pool.arena[0]));
+	if (!timeAr || !perfFd || !counterAr || !threadCpu || !loadBytes
+		 || !releaseAr
+		 || !barrierTree || !pool.thread || !pool.tid
+		 || !pool.arena)
+	{
+		printf ("Can't allocate tables for %d threads\n", threads);
+		exit (-1);
+	}
+	for (i = 0; i < threads; i++)
+		for (j = 0; j < MAX_COUNTERS; j++)
+			perfFd[i][j] = -1;
+}
+
+void
+add_step (int threads, int *cap)
+{
+	if (numSteps == *cap)
+	{
+		*cap = *cap ? *cap * 2 : 16;
+		schedule = realloc (schedule, *cap * sizeof (int));
+		if (schedule == NULL)
+		{
+			printf ("Can't allocate the thread schedule\n");
+			exit (-1);
+		}
+	}
+	schedule[numSteps++] = threads;
+}
+
+int
+compare_int (const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* Turn --threads into the sorted list of thread counts to run.  It is
+   a comma separated list of counts, a-b ranges with an optional :step,
+   and "all" for every count from 1 to -T.  Without it counts double
+   from -t to -T like they always have, --loaded just runs -T. */
+void
+build_schedule (struct idThreadParams *id)
+{
+	char *spec, *item, *save;
+	int cap = 0, i, n, lo, hi, step;
+
+	if (threadSpec == NULL && loadedMode)
+		add_step (id->maxThreads, &cap);
+	else if (threadSpec == NULL)
+	{
+		for (n = id->minThreads; n <= id->maxThreads; n = n * 2)
+			add_step (n, &cap);
+	}
+	else
+	{
+		spec = strdup (threadSpec);
+		for (item = strtok_r (spec, ",", &save); item;
+			  item = strtok_r (NULL, ",", &save))
+		{
+			step = 1;
+			if (strcmp (item, "all") == 0)
 			{
-				a[i] = b[i] + scalar * c[i];
+				lo = 1;
+				hi = id->maxThreads;
 			}
-			break;
-		case 1:
-			for (i = 0; i < size; i++)
+			else if (sscanf (item, "%d-%d:%d", &lo, &hi, &step) >= 2)
+				;
+			else if (sscanf (item, "%d", &lo) == 1)
+				hi = lo;
+			else
+				lo = 0;
+			if (lo < 1 || hi < lo || step < 1)
 			{
-				a[i] = b[i] + scalar * c[i];
+				printf ("Bad --threads entry %s\n", item);
+				exit (-1);
 			}
+			for (n = lo; n <= hi; n += step)
+				add_step (n, &cap);
 		}
+		free (spec);
 	}
-	timeAr[id->id][3] = second ();
-	for (i = 0; i < size; i++)
+	if (numSteps == 0)
+	{
+		printf ("No thread counts to run\n");
+		exit (-1);
+	}
+	qsort (schedule, numSteps, sizeof (int), compare_int);
+	for (i = n = 1; i < numSteps; i++)
+		if (schedule[i] != schedule[n - 1])
+			schedule[n++] = schedule[i];
+	numSteps = n;
+	releaseSkew = calloc (numSteps, sizeof (double));
+	id->minThreads = schedule[0];
+	id->maxThreads = schedule[numSteps - 1];
+}
+
+/* Bytes in a size argument: a number with an optional K, M, G or T
+   suffix (powers of 1024), in units of unit without one.  Exits on
+   junk, overflow and, unless zero is allowed, sizes of 0. */
+int64_t
+parse_size (char *arg, int64_t unit, int zero, char *what)
+{
+	char *end;
+	double v;
+	int shift = -1;
+
+	errno = 0;
+	v = strtod (arg, &end);
+	switch (toupper (*end))
+	{
+	case 'K':
+		shift = 10;
+		break;
+	case 'M':
+		shift = 20;
+		break;
+	case 'G':
+		shift = 30;
+		break;
+	case 'T':
+		shift = 40;
+		break;
+	}
+	if (shift >= 0)
+	{
+		end++;
+		if (toupper (*end) == 'B')
+			end++;
+		v = ldexp (v, shift);
+	}
+	else
+		v = v * unit;
+	if (errno || end == arg || *end != '\0' || v < 0 || v >= 0x1p62
+		 || (v < 1 && !zero))
+	{
+		printf ("Bad size %s for %s\n", arg, what);
+		exit (-1);
+	}
+	return (int64_t) v;
+}
+
+void
+help (char *argv[],struct idThreadParams id)
+{
+	printf ("Usage: %s <options>\n", argv[0]);
+	printf ("  [-a ] use sched_setaffinity, default off\n");
+	printf ("  [-A ] use sched_setaffinity striped across CPUs default off\n");
+	printf ("  [--placement=compact|socket|l3|core|smt] pin threads by topology:\n");
+	printf ("      compact  allowed cpus in order (same as -a)\n");
+	printf ("      socket   round robin over sockets, physical cores first\n");
+	printf ("      l3       round robin over L3 domains, physical cores first\n");
+	printf ("      core     one thread per physical core\n");
+	printf ("      smt      both hw threads of a core before the next core\n");
+	printf
+		("  [-c <set cache size in k bytes to align to>] default %" PRIu64
+		 ", set to zero to disable\n", cacheSize / 1024);
+	printf ("  [-f <filename to write data to>\n");
+	printf ("  [--isa=auto|scalar|sse2|avx2|avx512 kernel variant, default auto\n");
+	printf ("  [--nt use non-temporal (streaming) stores in the kernels\n");
+	printf ("  [--kernels=<list>] comma separated, from copy,scale,add,triad,sum,fill,rmw\n");
+	printf ("                     %s,\n", ENGINES_DEFAULT);
+	printf ("                     or mix:R:W, stride:N, gather:seq|rand|clust,\n"
+			  "                     scatter:seq|rand|clust, default add,triad\n");
+	printf ("  [--mix[=R:W,..]] kernels reading R and writing W %d double pieces\n"
+			  "      in turn over all three arrays, default %s\n", MIX_UNIT,
+			  MIX_DEFAULT);
+	printf ("  [--strides[=N,..]] kernels summing every Nth double, default\n"
+			  "      %s\n", STRIDE_DEFAULT);
+	printf ("  [--gather] gather and scatter through sequential, random and\n"
+			  "      clustered (runs of %d) indexes\n", INDEX_RUN);
+	printf ("  [--engines] libc, rep movsb/stosb, vector and streaming store copy\n"
+			  "      and fill, reporting where the fastest one changes; engines that\n"
+			  "      are another one on this ISA are left out\n");
+	printf ("  [--mlp=<K>] latency with 1, 2, 4 .. K independent chains per thread\n");
+	printf ("  [--seed=<N>] seed for the random latency chains, default random\n");
+	printf ("  [--threads=<list>] thread counts to run instead of doubling -t to -T,\n"
+			  "      e.g. 1,2,3 or 8-96:8 or all, default -t to -T\n");
+	printf ("  [--trials=<N>] measurements per point, best one is kept, default %d\n",
+			  trials);
+	printf ("                 when a point can take more than one trial, per point\n"
+			  "                 statistics go to <file>.stats\n");
+	printf ("  [--barrier=spin|tree|block] how threads line up before each timed\n"
+			  "      region, default %s\n", barrierName[barrierKind]);
+	printf ("  [--spin-timeout=<us>] spinners fall back to sleeping after this,\n"
+			  "      default %.0f\n", spinTimeout * 1.0e6);
+	printf ("  [--detail=<file>] per thread results, start/end skew and the slowest\n"
+			  "      thread of every trial\n");
+	printf ("  [--tolerance=<percent>] measure on until the last %d trials agree this\n"
+			  "      closely, 0 = just --trials, default %.0f\n", CONVERGE_WINDOW,
+			  tolerance * 100.0);
+	printf ("  [--max-trials=<N>] most trials spent converging, default %d\n",
+			  maxTrials);
+	printf ("  [--pages=4k|thp|2m|1g] page size for all arrays, default %s\n",
+			  pagesName[pages]);
+	printf ("  [--counters] add cycles, instructions, LLC and dTLB load misses per pass\n");
+	printf ("  [--raw-event=<hex>[,<hex>..]] also count these raw PMU events\n");
+	printf ("  [-i <what percentage to shrink the array>] default %f\n",
+			  increaseArray * 100.0);
+	printf ("  [-t <maximum number of threads>] default %d\n", id.minThreads);
+	printf ("  [-T <minimum number of threads>] default %d\n", id.maxThreads);
+	printf ("  [-m <minimum array size in K>] default %" PRId64 "\n",
+			  minMemory / 1024);
+	printf ("  [-M <maximum array size in M>] default %" PRIu64 "\n",
+			  maxMemory / (1024 * 1024));
+	printf ("      sizes for -m, -M and -c take a K, M, G or T suffix\n");
+	printf
+		("  [-p <number of pages] restricts most reads to within <N> pages, 0 disables\n");
+	printf ("  [-s <how many seconds per timestep>] default %f\n", timeStep);
+	printf ("  [--adaptive] octave steps, then bisect sizes where results change\n");
+	printf ("  [--resolution=<percent>] stop bisecting sizes this close, default -i\n");
+	printf ("  [--threshold=<percent>] change between sizes worth bisecting, default %.0f\n",
+			  adaptThreshold * 100.0);
+	printf ("  [--budget=<seconds>] time limit for an adaptive run, default none\n");
+	printf ("  [--shared align arrays to be friendly to a shared cache\n");
+	printf ("  [--numa-matrix] bandwidth and latency of every cpu node against\n");
+	printf ("                  every memory node, needs NUMA support\n");
+	printf ("  [--loaded] latency of --probes threads while the other -T threads run\n"
+			  "      the first kernel, from idle through pauses of --max-delay down to\n"
+			  "      none after every %d doubles\n", LOAD_CHUNK);
+	printf ("  [--c2c] round trip latency of a cache line between every pair of cpus,\n"
+			  "      with plain stores and loads and with compare and swap\n");
+	printf ("  [--atomics] fetch-add, CAS and exchange ops/sec on one shared word,\n"
+			  "      on a word each in a line per 8 threads and on a line each, per\n"
+			  "      thread count\n");
+	printf ("  [--first-touch] page fault-in MB/sec of -M split over the threads for\n"
+			  "      4k, THP, 2M and 1G pages, by writing, MAP_POPULATE (mlock for\n"
+			  "      4k and THP, 0 past RLIMIT_MEMLOCK) and MADV_POPULATE_WRITE,\n"
+			  "      on the local and a remote node; unreserved huge pages read 0\n");
+	printf ("  [--daemon[=<secs>]] every secs (default %.0f) one single thread\n"
+			  "      bandwidth point of the first kernel and one latency point per\n"
+			  "      node, twice L3 (at most -M) in size, appended to -f with a timestamp\n"
+			  "      (-f - for stdout)\n", probeInterval);
+	printf ("  [--duty=<percent>] most of the time --daemon spends probing,\n"
+			  "      default %.1f\n", probeDuty);
+	printf ("  [--rounds=<N>] stop --daemon after N rounds, default 0 = never\n");
+	printf ("  [--probes=<N>] latency threads in --loaded, default %d\n", probes);
+	printf ("  [--max-delay=<N>] most pauses per chunk in --loaded, default %lld\n",
+			  maxDelay);
+	printf ("  [-U turn on NUMA (if compiled in), default %d\n", usenuma);
+	printf ("  [-u turn off NUMA (if compiled in), default %d\n", usenuma);
+	printf ("  [-z <set cacheline size in bytes>] default %d\n",
+			  cacheLineSize);
+}
+
+char *
+fToStringDec (float x, char *result)
+{
+	int shift = 0;
+	char *postfix = " kmgtp";
+	while (x > 1000)
+	{
+		x = x / 1000;
+		shift++;
+	}
+	if (x < 10)
+		sprintf (result, "%4.3f%c", x, postfix[shift]);
+	else if (x < 100)
+		sprintf (result, "%4.2f%c", x, postfix[shift]);
+	else
+		sprintf (result, "%4.1f%c", x, postfix[shift]);
+
+	return (result);
+}
+
+char *
+fToStringBin (float x, char *result)
+{
+	int shift = 0;
+	char *postfix = "KMGTP";
+	while (x > 1000.0)
+	{
+		x = x / 1024;
+		shift++;
+	}
+	if (x < 10)
+		sprintf (result, "%4.3f%c", x, postfix[shift]);
+	else if (x < 100)
+		sprintf (result, "%4.2f%c", x, postfix[shift]);
+	else
+		sprintf (result, "%4.1f%c", x, postfix[shift]);
+
+	return (result);
+}
+
+
+/* events per pass over the arrays, summed over the threads */
+void
+counter_time (double *results)
+{
+	int s, e, t;
+	double sum;
+
+	for (s = 0; s < numSlots; s++)
+	{
+		for (e = 0; e < numCounters; e++)
+		{
+			sum = 0.0;
+			for (t = 0; t < cur_threads; t++)
+				sum += counterAr[t][s][e];
+			results[s * numCounters + e] = sum / scale;
+		}
+	}
+}
+
+/* timed regions and result columns for the current mode */
+void
+setup_columns ()
+{
+	int i;
+
+	if (firstTouch)
+	{
+		numSlots = TOUCH_SLOTS;
+		numColumns = numSlots * touchPlaces;
+		for (i = 0; i < numColumns; i++)
+		{
+			columns[i].name = columns[i].buf;
+			snprintf (columns[i].buf, sizeof (columns[i].buf), "%s:%s:%s",
+						 pagesName[(i % numSlots) / TOUCH_WAYS],
+						 touchName[i % TOUCH_WAYS], touchNodeName[i / numSlots]);
+			columns[i].unit = "MB/sec";
+			columns[i].higher = 1;
+		}
+	}
+	else if (atomicsMode)
+	{
+		numSlots = numColumns = 9;
+		for (i = 0; i < numSlots; i++)
+		{
+			columns[i].name = columns[i].buf;
+			snprintf (columns[i].buf, sizeof (columns[i].buf), "%s:%s",
+						 atomicOpName[i / 3], atomicWhereName[i % 3]);
+			columns[i].unit = "Mops/sec";
+			columns[i].higher = 1;
+		}
+	}
+	else if (band)
+	{
+		/* strided and indexed kernels also get lines per second */
+		for (i = 0; i < numKernels; i++)
+			if (kernelList[i].stride || kernelList[i].indexed)
+				lineColumns = 1;
+		numSlots = numKernels;
+		numColumns = numKernels * (lineColumns + 1);
+		for (i = 0; i < numKernels; i++)
+		{
+			struct column *col = &columns[i * (lineColumns + 1)];
+			col->name = kernelList[i].name;
+			col->unit = "MB/sec";
+			col->higher = 1;
+			if (lineColumns)
+			{
+				col[1].name = col[1].buf;
+				snprintf (col[1].buf, sizeof (col[1].buf), "%s:lines",
+							 kernelList[i].name);
+				col[1].unit = "Mlines/sec";
+				col[1].higher = 1;
+			}
+		}
+	}
+	else if (mlpMax)
+	{
+		numSlots = logint (mlpMax) + 1;
+		numColumns = numSlots * 2;
+		for (i = 0; i < numSlots; i++)
+		{
+			columns[i * 2].name = columns[i * 2].buf;
+			columns[i * 2 + 1].name = columns[i * 2 + 1].buf;
+			sprintf (columns[i * 2].buf, "lat_k%d", 1 << i);
+			sprintf (columns[i * 2 + 1].buf, "Mlines_k%d", 1 << i);
+			columns[i * 2].unit = "ns";
+			columns[i * 2 + 1].unit = "Mlines/sec";
+			columns[i * 2].higher = 0;
+			columns[i * 2 + 1].higher = 1;
+		}
+	}
+	else
+	{
+		numSlots = 1;
+		numColumns = 2;
+		columns[0].name = "lat";
+		columns[1].name = "avgLat";
+		columns[0].unit = columns[1].unit = "ns";
+		columns[0].higher = columns[1].higher = 0;
+	}
+	if (useCounters)
+	{
+		if (numColumns + numSlots * numCounters > MAX_COLUMNS)
+		{
+			printf ("Sorry, too many kernels times counters, at most %d columns\n",
+					  MAX_COLUMNS);
+			exit (-1);
+		}
+		/* per timed region, named after the column that region feeds */
+		for (i = 0; i < numSlots * numCounters; i++)
+		{
+			struct column *col = &columns[numColumns + i];
+			col->name = col->buf;
+			snprintf (col->buf, sizeof (col->buf), "%s:%s",
+						 columns[(i / numCounters) * (numColumns / numSlots)].name,
+						 counterTable[i % numCounters].name);
+			col->unit = "/pass";
+			col->higher = 0;
+		}
+		numColumns += numSlots * numCounters;
+	}
+}
+
+/* wall time of each timed region, from the first thread to start to
+   the last one to finish */
+void
+slot_times (double *difft)
+{
+	double max, min;
+	int i, j;
+
+	for (i = 0; i < numSlots; i++)
+	{
+/*	printf ("max=%f min=%f\n",DBL_MAX,DBL_MIN); */
+#ifndef PGCC_BROKEN
+		min = DBL_MAX;
+		max = DBL_MIN;
+#else
+		min = 1.7976931348623157e+208;
+		max = 2.2250738585072014e-208;
+#endif
+
+		for (j = 0; j < cur_threads; j++)
+		{
+			if (timeAr[j][i * 2] < min)
+			{
+				min = timeAr[j][i * 2];
+			}
+			if (timeAr[j][i * 2 + 1] > max)
+			{
+				max = timeAr[j][i * 2 + 1];
+			}
+		}
+		difft[i] = max - min;
+	}
+}
+
+int
+compare_double (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* min/median/mean/stddev/p95 of each column over the trials of a point */
+void
+write_stats (int64_t array_size, double *samples, int n, double *best)
+{
+	double v[n];
+	double mean, var;
+	int i, c;
+
+	if (statsFile == NULL)
+		return;
+	for (c = 0; c < numColumns; c++)
+	{
+		mean = 0.0;
+		for (i = 0; i < n; i++)
+		{
+			v[i] = samples[i * numColumns + c];
+			mean += v[i];
+		}
+		mean = mean / n;
+		var = 0.0;
+		for (i = 0; i < n; i++)
+			var += (v[i] - mean) * (v[i] - mean);
+		var = n > 1 ? var / (n - 1) : 0.0;
+		qsort (v, n, sizeof (double), compare_double);
+		fprintf (statsFile,
+					"%d %10.2f %-12s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %d\n",
+					cur_threads, array_size / 1024.0, columns[c].name, best[c],
+					v[0], n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2.0, mean,
+					sqrt (var), v[(int) ((n - 1) * 0.95 + 0.5)], n);
+	}
+	fflush (statsFile);
+}
+
+/* the timed columns of a run of threads threads taking times */
+void
+point_values (double *times, double *r, int threads)
+{
+	int i;
+
+	if (atomicsMode)
+	{
+		for (i = 0; i < numSlots; i++)
+			r[i] = (double) threads * scale / times[i] / 1.0e6;
+	}
+	if (lat == 1 && mlpMax)
+		mlp_time (times, r, maxmem, scale, threads);
+	else if (lat == 1)
+		latency_time (times, r, maxmem, scale, threads);
+	if (band == 1)
+		bandwidth_time (times, r, maxmem, scale, threads);
+}
+
+/* One line per timed region of a trial: how far apart the threads
+   started and finished, the spread of what each thread got on its own
+   and which thread was the worst, then every thread's value. */
+void
+write_detail (int64_t array_size, int trial)
+{
+	double v[cur_threads][numSlots];
+	double times[BENCHMARKS], r[MAX_COLUMNS];
+	double s0, s1, e0, e1, lo, hi, mean;
+	int perSlot = (numColumns - numSlots * numCounters) / numSlots;
+	int s, t, worst;
+	struct column *col;
+
+	if (detailFile == NULL)
+		return;
+	for (t = 0; t < cur_threads; t++)
+	{
+		for (s = 0; s < numSlots; s++)
+			times[s] = timeAr[t][s * 2 + 1] - timeAr[t][s * 2];
+		point_values (times, r, 1);
+		for (s = 0; s < numSlots; s++)
+			v[t][s] = r[s * perSlot];
+	}
+	for (s = 0; s < numSlots; s++)
+	{
+		col = &columns[s * perSlot];
+		s0 = e0 = DBL_MAX;
+		s1 = e1 = -DBL_MAX;
+		lo = DBL_MAX;
+		hi = -DBL_MAX;
+		mean = 0.0;
+		worst = 0;
+		for (t = 0; t < cur_threads; t++)
+		{
+			s0 = fmin (s0, timeAr[t][s * 2]);
+			s1 = fmax (s1, timeAr[t][s * 2]);
+			e0 = fmin (e0, timeAr[t][s * 2 + 1]);
+			e1 = fmax (e1, timeAr[t][s * 2 + 1]);
+			lo = fmin (lo, v[t][s]);
+			hi = fmax (hi, v[t][s]);
+			mean += v[t][s];
+			if (col->higher ? v[t][s] < v[worst][s] : v[t][s] > v[worst][s])
+				worst = t;
+		}
+		mean = mean / cur_threads;
+		fprintf (detailFile, "%d %10.2f %d %-12s %10.2f %10.2f %10.2f %10.2f "
+					"%10.2f %6.3f %d %d :", cur_threads, array_size / 1024.0,
+					trial, col->name, (s1 - s0) * 1.0e6, (e1 - e0) * 1.0e6, lo,
+					hi, mean, mean > 0 ? (hi - lo) / mean : 0.0, worst,
+					threadCpu[worst]);
+		for (t = 0; t < cur_threads; t++)
+			fprintf (detailFile, " %.2f", v[t][s]);
+		fprintf (detailFile, "\n");
+	}
+}
+
+/* one command on the running pool; 0 if a timed region didn't register */
+int
+run_once (double *difft)
+{
+	int i;
+
+	if (atomicsMode)
+		pool_run (CMD_ATOMICS, maxmem, scale);
+	if (band == 1)
+		pool_run (CMD_STREAM, maxmem, scale);
+	if (lat == 1)
+		pool_run (CMD_LATENCY, maxmem, scale);
+	slot_times (difft);
+	for (i = 0; i < numSlots; i++)
+	{
+		if (difft[i] <= 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* shortest timed region of a run */
+double
+min_slot (double *difft)
+{
+	double shortest = difft[0];
+	int i;
+
+	for (i = 1; i < numSlots; i++)
+		if (difft[i] < shortest)
+			shortest = difft[i];
+	return shortest;
+}
+
+/* Warm the arrays and caches with an untimed run, then rescale until
+   every timed region takes at least timeStep.  The scale on entry is
+   only a starting guess.  Returns 0 if the timings never registered. */
+int
+calibrate (double *diff)
+{
+	double difft[BENCHMARKS], shortest;
+	int tries;
+
+	if (scale < 1)
+		scale = 1;
+	if (!run_once (difft))
+		return 0;
+	for (tries = 0; tries < 16; tries++)
+	{
+		if (!run_once (difft))
+			return 0;
+		shortest = min_slot (difft);
+		*diff = shortest;
+		if (shortest >= timeStep && (shortest < 2 * timeStep || scale == 1))
+			return 1;
+		/* aim a little over so noise doesn't leave us just short */
+		scale = ceil (scale * (timeStep / shortest) * 1.05);
+		if (scale < 1)
+			scale = 1;
+	}
+	return 1;
+}
+
+/* 1 if the last CONVERGE_WINDOW samples of every timed column are within
+   tolerance of each other */
+int
+converged (double *samples, int n)
+{
+	double lo, hi, v;
+	int i, c;
+
+	if (tolerance <= 0)
+		return 1;
+	if (n < CONVERGE_WINDOW)
+		return 0;
+	for (c = 0; c < numColumns - numSlots * numCounters; c++)
+	{
+		lo = DBL_MAX;
+		hi = -DBL_MAX;
+		for (i = n - CONVERGE_WINDOW; i < n; i++)
+		{
+			v = samples[i * numColumns + c];
+			lo = v < lo ? v : lo;
+			hi = v > hi ? v : hi;
+		}
+		if (hi - lo > tolerance * fabs (hi))
+			return 0;
+	}
+	return 1;
+}
+
+/* Measure one point at least trials times, and on until the results
+   converge or maxTrials, keep the best value of each column in results
+   and return how many trials had usable timings.  diff is set to the
+   shortest timed region seen. */
+int
+measure_point (int64_t array_size, double *results, double *diff)
+{
+	double difft[BENCHMARKS], r[MAX_COLUMNS];
+	double *samples, shortest = DBL_MAX;
+	int t, i, n = 0, most = trials > maxTrials ? trials : maxTrials;
+	int timed = numColumns - numSlots * numCounters, best = 0;
+
+	samples = malloc (sizeof (double) * most * numColumns);
+	for (t = 0; t < most && (t < trials || !converged (samples, n)); t++)
+	{
+		if (!run_once (difft))
+			continue;
+		if (min_slot (difft) < shortest)
+			shortest = min_slot (difft);
+		point_values (difft, r, cur_threads);
+		write_detail (array_size, t);
+		if (useCounters)
+			counter_time (r + numColumns - numSlots * numCounters);
+		for (i = 0; i < numColumns; i++)
+		{
+			samples[n * numColumns + i] = r[i];
+			if (n == 0 || (columns[i].higher ? r[i] > results[i]
+								: r[i] < results[i]))
+			{
+				if (i == 0)
+					best = n;
+				results[i] = r[i];
+			}
+		}
+		n++;
+	}
+	if (n > 0)
+	{
+		/* counters explain the first column, so keep them from its best
+		   trial rather than each one's own minimum */
+		for (i = timed; i < numColumns; i++)
+			results[i] = samples[best * numColumns + i];
+		*diff = shortest;
+		write_stats (array_size, samples, n, results);
+	}
+	free (samples);
+	return n;
+}
+
+/* Median and worst spread of the release times over BARRIER_ROUNDS
+   barriers on the running pool, in microseconds; returns the median. */
+double
+barrier_skew ()
+{
+	double skew[BARRIER_ROUNDS], lo, hi, v;
+	int r, t;
+
+	pool_run (CMD_BARRIER, 0, 0);
+	for (r = 0; r < BARRIER_ROUNDS; r++)
+	{
+		lo = DBL_MAX;
+		hi = -DBL_MAX;
+		for (t = 0; t < cur_threads; t++)
+		{
+			v = releaseAr[r * cur_threads + t];
+			lo = v < lo ? v : lo;
+			hi = v > hi ? v : hi;
+		}
+		skew[r] = (hi - lo) * 1.0e6;
+	}
+	qsort (skew, BARRIER_ROUNDS, sizeof (double), compare_double);
+	printf ("barrier=%s release skew median=%.2fus max=%.2fus\n",
+			  barrierName[barrierUsed], skew[BARRIER_ROUNDS / 2],
+			  skew[BARRIER_ROUNDS - 1]);
+	return skew[BARRIER_ROUNDS / 2];
+}
+
+/* measure one point of maxMemory on the running pool */
+int
+single_point (double *results)
+{
+	double diff;
+
+	scale = REPEAT;
+	maxmem = maxMemory / cur_threads;
+	if (!calibrate (&diff))
+		return 0;
+	return measure_point (maxMemory, results, &diff) > 0;
+}
+
+/* measure array_size on the running pool, print it and file it under
+   its row; returns the row or -1 */
+int
+run_point (int64_t array_size, double *diff)
+{
+	char result1[16], result2[16];
+	double results[MAX_COLUMNS];
+	int i, n, row = -1;
+
+	/* maxmem = bytes per thread to use */
+	maxmem = array_size / cur_threads;
+	if (!calibrate (diff))
+		return -1;
+	printf ("%d Thread(s) size=%sB repeat=%s ", cur_threads,
+			  fToStringBin (array_size / 1024.0, result1),
+			  fToStringDec ((float) scale, result2));
+	n = measure_point (array_size, results, diff);
+	if (n > 0)
+	{
+		row = find_row (array_size);
+		printf ("diff=%8.7f ", *diff);
+		if (n != trials)
+			printf ("trials=%d ", n);
+		for (i = 0; i < numColumns; i++)
+		{
+			printf ("%s = %6.2f %s ", columns[i].name, results[i],
+					  columns[i].unit);
+			if (row >= 0)
+				RESULT (row, curStep)[i] = results[i];
+		}
+		if (row >= 0)
+			measuredAr[row * numSteps + curStep] = 1;
+/*	      printf ("cur=%d index=%d\n", cur_threads, log[cur_threads]); */
+		printf ("\n");
+	}
+	return row;
+}
+
+/* run_point with the scale predicted from the seconds per byte per
+   repetition of the last point */
+int
+adaptive_point (int64_t array_size, double *secPerByte)
+{
+	double diff;
+	int row;
+
+	scale = REPEAT;
+	if (*secPerByte > 0)
+		scale = timeStep / (*secPerByte * array_size);
+	if (scale < 1)
+		scale = 1;
+	row = run_point (array_size, &diff);
+	if (row >= 0)
+		*secPerByte = diff / ((double) scale * array_size);
+	return row;
+}
+
+/* An octave-spaced coarse pass, then keep splitting the neighbouring
+   pair with the sharpest change at its geometric middle until every
+   change is under the threshold, the sizes are within the resolution or
+   the deadline passes. */
+void
+adaptive_sweep (double deadline)
+{
+	int r, hi, pick, pickLo;
+	int64_t array_size, mid;
+	double secPerByte = 0.0, change, best, v0, v1;
+	double resolution = adaptResolution > 0 ? adaptResolution :
+		1.0 / increaseArray;
+
+	/* the first point always, so there is something to show */
+	for (array_size = maxMemory; array_size >= minMemory; array_size /= 2)
+	{
+		if (array_size < maxMemory && adaptBudget > 0 && second () >= deadline)
+			return;
+		adaptive_point (array_size, &secPerByte);
+	}
+	while (adaptBudget <= 0 || second () < deadline)
+	{
+		pick = pickLo = -1;
+		best = 0.0;
+		hi = -1;
+		for (r = 0; r < numRows; r++)
+		{
+			if (!measuredAr[r * numSteps + curStep])
+				continue;
+			if (hi >= 0 && (double) rowSize[hi] / rowSize[r] > resolution
+				 && rowSize[hi] - rowSize[r] > 2048)
+			{
+				v0 = RESULT (hi, curStep)[0];
+				v1 = RESULT (r, curStep)[0];
+				change = fabs (v0 - v1) / fmax (fmin (v0, v1), 1e-9);
+				if (change > adaptThreshold && change > best)
+				{
+					best = change;
+					pick = hi;
+					pickLo = r;
+				}
+			}
+			hi = r;
+		}
+		if (pick < 0)
+			break;
+		/* geometric middle, on a 1KB boundary if one falls inside */
+		mid = (int64_t) sqrt ((double) rowSize[pick] * rowSize[pickLo]);
+		if ((mid & ~(int64_t) 1023) > rowSize[pickLo])
+			mid = mid & ~(int64_t) 1023;
+		else
+			mid = mid & ~(int64_t) (cacheLineSize - 1);
+		if (adaptive_point (mid, &secPerByte) < 0)
+			break;
+	}
+}
+
+#ifdef USENUMA
+void
+print_matrix (FILE * fp, char *title, double *m, int nodes)
+{
+	int c, n;
+
+	fprintf (fp, "#%s, rows = cpu node, columns = memory node\n", title);
+	fprintf (fp, "%-6s", "node");
+	for (n = 0; n < nodes; n++)
+		fprintf (fp, " %10d", n);
+	fprintf (fp, "\n");
+	for (c = 0; c < nodes; c++)
+	{
+		fprintf (fp, "%-6d", c);
+		for (n = 0; n < nodes; n++)
+			fprintf (fp, " %10.2f", m[c * nodes + n]);
+		fprintf (fp, "\n");
+	}
+}
+
+/* For every (cpu node, memory node) pair run the node's cpus (up to
+   maxThreads) against memory bound to the other node, once with the
+   first bandwidth kernel and once chasing pointers. */
+void
+numa_matrix (char *logfile, int maxThreads)
+{
+	int nodes = numa_max_node () + 1;
+	double bw[nodes * nodes], lt[nodes * nodes];
+	double results[MAX_COLUMNS];
+	struct bitmask *cpus = numa_allocate_cpumask ();
+	int c, m, mode, threads;
+	FILE *fp;
+
+	for (c = 0; c < nodes * nodes; c++)
+		bw[c] = lt[c] = 0.0;
+	for (c = 0; c < nodes; c++)
+	{
+		/* memory only nodes quietly, cpuset exclusions with a note */
+		if (numa_node_to_cpus (c, cpus) < 0 || numa_bitmask_weight (cpus) == 0)
+			continue;
+		threads = node_cpus (c, cpus);
+		if (threads == 0)
+		{
+			printf ("cpu node %d: no allowed cpus, skipped\n", c);
+			continue;
+		}
+		if (threads > maxThreads)
+			threads = maxThreads;
+		for (m = 0; m < nodes; m++)
+		{
+			if (!numa_bitmask_isbitset (numa_all_nodes_ptr, m))
+				continue;
+			pool.cpuNode = c;
+			pool.memNode = m;
+			for (mode = 0; mode < 2; mode++)
+			{
+				band = (mode == 0);
+				lat = (mode == 1);
+				setup_columns ();
+				cur_threads = threads;
+				pool_start (threads, maxMemory / threads);
+				if (single_point (results))
+				{
+					if (band)
+						bw[c * nodes + m] = results[0];
+					else
+						lt[c * nodes + m] = results[0];
+				}
+				pool_stop ();
+			}
+			printf ("cpu node %d (%d threads) memory node %d: %s = %.2f MB/sec "
+					  "latency = %.2f ns\n", c, threads, m,
+					  kernelList[0].name, bw[c * nodes + m],
+					  lt[c * nodes + m]);
+		}
+	}
+	numa_bitmask_free (cpus);
+	pool.cpuNode = pool.memNode = -1;
+
+	print_matrix (stdout, "bandwidth MB/sec", bw, nodes);
+	print_matrix (stdout, "latency ns", lt, nodes);
+	fp = fopen (logfile, "w");
+	if (fp == NULL)
+	{
+		printf ("Can't write %s\n", logfile);
+		exit (-1);
+	}
+	fprintf (fp, "#numa matrix maxMemory=%" PRIu64 " maxThreads=%d "
+				"timestep=%f kernel=%s\n", maxMemory, maxThreads, timeStep,
+				kernelList[0].name);
+	fprintf (fp, "#isa=%s ntStores=%d pages=%s effective=%s mlp=%d\n",
+				isaName[isa], ntStores, pagesName[pages],
+				pagesName[pagesGot < 0 ? pages : pagesGot], mlpMax);
+	print_matrix (fp, "bandwidth MB/sec", bw, nodes);
+	print_matrix (fp, "latency ns", lt, nodes);
+	fclose (fp);
+}
+#endif
+
+/* Atomic ops per second for every thread count of the schedule, one
+   row per count. */
+void
+atomics_sweep (char *logfile, int maxThreads)
+{
+	double results[MAX_COLUMNS], diff;
+	int i, groups = (maxThreads + 7) / 8;
+	FILE *fp;
+
+	if (posix_memalign ((void **) &atomicLines, 128,
+							  (maxThreads + 1) * sizeof (atomicLines[0]))
+		 || posix_memalign ((void **) &atomicGroups, 128,
+								  groups * sizeof (atomicGroups[0])))
+	{
+		printf ("Can't allocate the atomic lines\n");
+		exit (-1);
+	}
+	memset (atomicLines, 0, (maxThreads + 1) * sizeof (atomicLines[0]));
+	memset (atomicGroups, 0, groups * sizeof (atomicGroups[0]));
+	fp = fopen (logfile, "w");
+	if (fp == NULL)
+	{
+		printf ("Can't write %s\n", logfile);
+		exit (-1);
+	}
+	fprintf (fp, "#atomics timestep=%f trials=%d barrier=%s placement=%s\n",
+				timeStep, trials, barrierName[barrierKind], placeName[placement]);
+	fprintf (fp, "#threads");
+	for (i = 0; i < numColumns; i++)
+		fprintf (fp, " %s", columns[i].name);
+	fprintf (fp, " (%s)\n", columns[0].unit);
+	for (curStep = 0; curStep < numSteps; curStep++)
+	{
+		cur_threads = schedule[curStep];
+		/* the arenas go unused, keep them small */
+		maxmem = 64 * 1024;
+		pool_start (cur_threads, maxmem);
+		releaseSkew[curStep] = barrier_skew ();
+		scale = 1000;
+		if (calibrate (&diff) && measure_point (0, results, &diff) > 0)
+		{
+			printf ("%d Thread(s) repeat=%lld", cur_threads, scale);
+			fprintf (fp, "%d", cur_threads);
+			for (i = 0; i < numColumns; i++)
+			{
+				printf (" %s = %.2f", columns[i].name, results[i]);
+				fprintf (fp, " %10.2f", results[i]);
+			}
+			printf (" %s\n", columns[0].unit);
+			fprintf (fp, "\n");
+			fflush (fp);
+		}
+		pool_stop ();
+	}
+	fclose (fp);
+	free (atomicLines);
+	free (atomicGroups);
+}
+
+/* Fault-in MB/sec of maxMemory split over every thread count of the
+   schedule, one row per count, best of the trials.  A page kind the
+   system couldn't hand out reads 0. */
+void
+touch_sweep (char *logfile)
+{
+	double results[MAX_COLUMNS], difft[BENCHMARKS], mb;
+	int i, k, t;
+	FILE *fp;
+
+	fp = fopen (logfile, "w");
+	if (fp == NULL)
+	{
+		printf ("Can't write %s\n", logfile);
+		exit (-1);
+	}
+	fprintf (fp, "#first-touch maxMemory=%" PRIu64 " trials=%d placement=%s "
+				"nodes=%d\n", maxMemory, trials, placeName[placement],
+				touchPlaces);
+	fprintf (fp, "#threads");
+	for (i = 0; i < numColumns; i++)
+		fprintf (fp, " %s", columns[i].name);
+	fprintf (fp, " (%s)\n", columns[0].unit);
+	for (curStep = 0; curStep < numSteps; curStep++)
+	{
+		cur_threads = schedule[curStep];
+		/* the arenas go unused, keep them small */
+		pool_start (cur_threads, 64 * 1024);
+		maxmem = (maxMemory / cur_threads + 4095) & ~(int64_t) 4095;
+		for (i = 0; i < numColumns; i++)
+			results[i] = 0.0;
+		for (touchRemote = 0; touchRemote < touchPlaces; touchRemote++)
+		{
+			for (t = 0; t < trials; t++)
+			{
+				memset (touchBytes, 0, sizeof (touchBytes));
+				memset (touchFailed, 0, sizeof (touchFailed));
+				pool_run (CMD_TOUCH, maxmem, 1);
+				slot_times (difft);
+				for (k = 0; k < numSlots; k++)
+				{
+					if (touchFailed[k] || difft[k] <= 0)
+						continue;
+					mb = touchBytes[k] / difft[k] / (1024.0 * 1024.0);
+					i = touchRemote * numSlots + k;
+					results[i] = fmax (results[i], mb);
+				}
+			}
+		}
+		printf ("%d Thread(s) size=%.2fMB", cur_threads,
+				  maxmem / (1024.0 * 1024.0));
+		fprintf (fp, "%d", cur_threads);
+		for (i = 0; i < numColumns; i++)
+		{
+			printf (" %s = %.2f", columns[i].name, results[i]);
+			fprintf (fp, " %10.2f", results[i]);
+		}
+		printf (" %s\n", columns[0].unit);
+		fprintf (fp, "\n");
+		fflush (fp);
+		pool_stop ();
+	}
+	fclose (fp);
+}
+
+/* One single thread point on node's cpus and memory (-1 = as usual) for
+   whichever of band and lat is set.  The scale calibrated the first time
+   is kept in *probeScale so later probes are one timed run; it is found
+   again when a run comes out too short. */
+double
+daemon_probe (int node, long long *probeScale)
+{
+	double difft[BENCHMARKS], r[MAX_COLUMNS], diff, value = 0.0;
+	int ok = 1;
+
+	setup_columns ();
+	cur_threads = 1;
+	pool.cpuNode = pool.memNode = node;
+	pool_start (1, maxmem);
+	scale = *probeScale;
+	if (scale == 0)
+	{
+		scale = REPEAT;
+		ok = calibrate (&diff);
+	}
+	*probeScale = 0;
+	if (ok && run_once (difft))
+	{
+		point_values (difft, r, 1);
+		value = r[0];
+		if (min_slot (difft) >= timeStep / 2)
+			*probeScale = scale;
+	}
+	pool_stop ();
+	pool.cpuNode = pool.memNode = -1;
+	return value;
+}
+
+/* Probe the first kernel's bandwidth and the latency of twice L3 (at
+   most -M) per node, forever or for probeRounds rounds, appending a timestamped
+   line per node to logfile (- for stdout).  Rounds start every
+   probeInterval seconds, later if that would go over probeDuty. */
+void
+daemon_probes (char *logfile)
+{
+	int maxNodes = 1, numNodes = 0, *nodeList, n;
+	long long (*probeScale)[2], round;
+	double start, busy, wait, bw, lt;
+	struct timespec now, pause;
+	struct tm tm;
+	char stamp[32];
+	FILE *fp;
+
+#ifdef USENUMA
+	if (numa_available () >= 0)
+		maxNodes = numa_max_node () + 1;
+#endif
+	nodeList = calloc (maxNodes, sizeof (nodeList[0]));
+	probeScale = calloc (maxNodes, sizeof (probeScale[0]));
+	if (nodeList == NULL || probeScale == NULL)
+	{
+		printf ("Can't allocate the probe tables\n");
+		exit (-1);
+	}
+#ifdef USENUMA
+	if (numa_available () >= 0)
+	{
+		struct bitmask *cpus = numa_allocate_cpumask ();
+
+		/* the nodes with both cpus and memory, one per socket */
+		for (n = 0; n < maxNodes; n++)
+		{
+			if (numa_bitmask_isbitset (numa_all_nodes_ptr, n)
+				 && node_cpus (n, cpus) > 0)
+				nodeList[numNodes++] = n;
+		}
+		numa_bitmask_free (cpus);
+	}
+#endif
+	if (numNodes == 0)
+		nodeList[numNodes++] = -1;
+	maxmem = l3Size > 0 ? 2 * l3Size : 64 * 1024 * 1024;
+	if (maxmem > maxMemory)
+		maxmem = maxMemory;
+
+	fp = strcmp (logfile, "-") == 0 ? stdout : fopen (logfile, "a");
+	if (fp == NULL)
+	{
+		printf ("Can't write %s\n", logfile);
+		exit (-1);
+	}
+	fprintf (fp, "#daemon interval=%f duty=%f%% probeMemory=%" PRId64
+				" timestep=%f kernel=%s isa=%s pages=%s\n", probeInterval,
+				probeDuty, maxmem, timeStep, kernelList[0].name, isaName[isa],
+				pagesName[pages]);
+	fprintf (fp, "#time epoch node %s(MB/sec) lat(ns) busy(s)\n",
+				kernelList[0].name);
+	fflush (fp);
+	for (round = 0; probeRounds == 0 || round < probeRounds; round++)
+	{
+		start = second ();
+		for (n = 0; n < numNodes; n++)
+		{
+			busy = second ();
+			band = 1;
+			lat = 0;
+			bw = daemon_probe (nodeList[n], &probeScale[n][0]);
+			band = 0;
+			lat = 1;
+			lt = daemon_probe (nodeList[n], &probeScale[n][1]);
+			busy = second () - busy;
+			clock_gettime (CLOCK_REALTIME, &now);
+			gmtime_r (&now.tv_sec, &tm);
+			strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+			fprintf (fp, "%s %ld.%03ld %d %10.2f %8.2f %6.3f\n", stamp,
+						(long) now.tv_sec, now.tv_nsec / 1000000, nodeList[n], bw,
+						lt, busy);
+			fflush (fp);
+		}
+		if (probeRounds != 0 && round + 1 == probeRounds)
+			break;
+		/* stretch the interval rather than go over the duty cycle */
+		busy = second () - start;
+		wait = fmax (probeInterval, busy * 100.0 / probeDuty) - busy;
+		if (wait > 0)
+		{
+			pause.tv_sec = (time_t) wait;
+			pause.tv_nsec = (long) ((wait - pause.tv_sec) * 1.0e9);
+			while (nanosleep (&pause, &pause) != 0 && errno == EINTR);
+		}
+	}
+	if (fp != stdout)
+		fclose (fp);
+	free (nodeList);
+	free (probeScale);
+}
+
+/* Average probe latency in ns and total load bandwidth in MB/sec for one
+   loadDelay, averaged over the trials. */
+void
+loaded_point (double *latency, double *bandwidth)
+{
+	double times[BENCHMARKS], r[MAX_COLUMNS], bytes, secs;
+	int t, i;
+
+	*latency = *bandwidth = 0.0;
+	for (t = 0; t < trials; t++)
+	{
+		probesDone = 0;
+		pool_run (CMD_LOADED, maxmem, scale);
+		for (i = 0; i < probes; i++)
+		{
+			times[0] = timeAr[i][1] - timeAr[i][0];
+			latency_time (times, r, maxmem, scale, 1);
+			*latency += r[0] / probes / trials;
+		}
+		bytes = 0.0;
+		secs = 0.0;
+		for (i = probes; i < cur_threads; i++)
+		{
+			bytes += loadBytes[i];
+			secs = fmax (secs, timeAr[i][1] - timeAr[i][0]);
+		}
+		if (secs > 0)
+			*bandwidth += bytes / secs / (1024.0 * 1024.0) / trials;
+	}
+}
+
+/* Latency against bandwidth: probe threads chase pointers while the
+   other threads run the first kernel with less and less pausing, from
+   idle to flat out. */
+void
+loaded_latency (char *logfile, int threads)
+{
+	double latency = 0.0, bandwidth;
+	char result1[16];
+	FILE *fp;
+
+	fp = fopen (logfile, "w");
+	if (fp == NULL)
+	{
+		printf ("Can't write %s\n", logfile);
+		exit (-1);
+	}
+	cur_threads = threads;
+	maxmem = maxMemory / threads;
+	pool_start (threads, maxmem);
+	barrier_skew ();
+	/* size the probes' repeat count to timeStep with the load idle */
+	loadDelay = -1;
+	/* a walk too short for the clock reads 0, walk more until it shows */
+	for (scale = 1; scale <= 1 << 16; scale *= 2)
+	{
+		loaded_point (&latency, &bandwidth);
+		if (latency > 0)
+			break;
+	}
+	if (latency <= 0)
+	{
+		printf ("The probes' timings never registered, try a larger -M\n");
+		exit (-1);
+	}
+	scale = ceil (timeStep / (1.0e-9 * latency * (maxmem / cacheLineSize)));
+	if (scale < 1)
+		scale = 1;
+	fprintf (fp, "#loaded latency maxMemory=%" PRIu64 " threads=%d probes=%d "
+				"kernel=%s isa=%s ntStores=%d\n", maxMemory, threads, probes,
+				kernelList[0].name, isaName[isa], ntStores);
+	fprintf (fp, "#timestep=%f trials=%d repeat=%lld pages=%s placement=%s "
+				"seed=%" PRIu64 "\n", timeStep, trials, scale, pagesName[pages],
+				placeName[placement], seed);
+	fprintf (fp, "#delay MB/sec latency_ns, delay -1 = idle load threads\n");
+	printf ("%d probe(s) of %sB each, %d load threads\n", probes,
+			  fToStringBin (maxmem / 1024.0, result1), threads - probes);
+	/* idle first, then flat out and halving the load from there */
+	for (loadDelay = -1; loadDelay <= maxDelay;
+		  loadDelay = loadDelay > 0 ? loadDelay * 2 : loadDelay + 1)
+	{
+		loaded_point (&latency, &bandwidth);
+		printf ("delay=%lld load = %10.2f MB/sec latency = %7.2f ns\n",
+				  loadDelay, bandwidth, latency);
+		fprintf (fp, "%lld %10.2f %7.2f\n", loadDelay, bandwidth, latency);
+		fflush (fp);
+	}
+	pool_stop ();
+	fclose (fp);
+}
+
+#ifdef USEAFFINITY
+/* --c2c: one cache line bounced between every ordered pair of cpus.
+   main pings from the row cpu, a helper thread pongs from the column
+   cpu, both repinned for every pair.  A round trip is the line going
+   over and coming back. */
+#define C2C_ROUNDS 10000
+#define C2C_STORE 0
+#define C2C_CAS 1
+static char *c2cName[] = { "store/load", "cas" };
+
+struct c2cControl {
+	int gen;							  /* bumped for every pair */
+	int cpu;
+	int kind;
+	int quit;
+} __attribute__ ((aligned (64)));
+
+static struct c2cControl c2cCtl;
+/* the helper's answer to gen: gen once pinned, -gen if it couldn't be */
+static int c2cReady __attribute__ ((aligned (64)));
+static int64_t c2cLine __attribute__ ((aligned (64)));
+
+/* the odd values are the pinger's, the even ones the ponger's */
+static void
+c2c_bounce (int kind, int64_t mine, int64_t rounds)
+{
+	int64_t k, want, next;
+
+	for (k = 0; k < rounds; k++)
 	{
-		if (c[i] == 3.14159)
+		want = 2 * k + mine - 1;
+		next = want + 1;
+		if (kind == C2C_CAS)
 		{
-			printf ("foo\n");
+			int64_t expect = want;
+			while (!__atomic_compare_exchange_n (&c2cLine, &expect, next, 0,
+															 __ATOMIC_ACQ_REL,
+															 __ATOMIC_ACQUIRE))
+			{
+				expect = want;
+				cpu_relax ();
+			}
 		}
-		if (b[i] == 3.14159)
+		else
 		{
-			printf ("foo\n");
+			while (__atomic_load_n (&c2cLine, __ATOMIC_ACQUIRE) != want)
+				cpu_relax ();
+			__atomic_store_n (&c2cLine, next, __ATOMIC_RELEASE);
 		}
 	}
-/*	printf ("diff=%f scale=%d size=%d\n", timeAr[id][3]-  timeAr[id][2] ,scale,size); */
-	/* Do not allow free's to slow down other threads with work to do. */
-	sync_thread (id->id, label[2]);
-	if (usenuma)
-	{
-#ifdef USENMA
-		printf ("freeing %d\n",size * sizeof (double) + 2 * cacheSize + 2 * cacheLineSize);
-		numa_free (aa, size * sizeof (double) + 2 * cacheSize + 2 * cacheLineSize);
-		numa_free (bb, size * sizeof (double) + 2 * cacheSize + 2 * cacheLineSize);
-		numa_free (cc, size * sizeof (double) + 2 * cacheSize + 2 * cacheLineSize);
-#endif
-	}
-	else
+}
+
+void *
+c2c_thread (void *arg)
+{
+	int seen = 0;
+
+	while (1)
 	{
-		free (aa);
-		free (bb);
-		free (cc);
+		while (__atomic_load_n (&c2cCtl.gen, __ATOMIC_ACQUIRE) == seen)
+			cpu_relax ();
+		seen = c2cCtl.gen;
+		if (c2cCtl.quit)
+			break;
+		if (pin_cpu (c2cCtl.cpu) != 0)
+		{
+			__atomic_store_n (&c2cReady, -seen, __ATOMIC_RELEASE);
+			continue;
+		}
+		__atomic_store_n (&c2cReady, seen, __ATOMIC_RELEASE);
+		c2c_bounce (c2cCtl.kind, 2, C2C_ROUNDS);
 	}
-	pthread_exit (NULL);
 	return NULL;
 }
 
-void
-help (char *argv[],struct idThreadParams id)
+/* best round trip in ns from cpu a to cpu b, an untimed round first;
+   -1 if either cpu can't be run on */
+double
+c2c_pair (int a, int b, int kind)
 {
-	printf ("Usage: %s <options>\n", argv[0]);
-	printf ("  [-a ] use sched_setaffinity, default off\n");
-	printf ("  [-A ] use sched_setaffinity striped across CPUs default off\n");
-	printf
-		("  [-c <set cache size in k bytes to align to>] default %" PRIu64
-		 ", set to zero to disable\n", cacheSize / 1024);
-	printf ("  [-f <filename to write data to>\n");
-	printf ("  [-i <what percentage to shrink the array>] default %f\n",
-			  increaseArray * 100.0);
-	printf ("  [-t <maximum number of threads>] default %d\n", id.minThreads);
-	printf ("  [-T <minimum number of threads>] default %d\n", id.maxThreads);
-	printf ("  [-m <minimum array size in K>] default %d\n", minMemory / 1024);
-	printf ("  [-M <maximum array size in M>] default %" PRIu64 "\n",
-			  maxMemory / 1024);
-	printf
-		("  [-p <number of pages] restricts most reads to within <N> pages, 0 disables\n");
-	printf ("  [-s <how many seconds per timestep>] default %f\n", timeStep);
-	printf ("  [--shared align arrays to be friendly to a shared cache\n");
-	printf ("  [-U turn on NUMA (if compiled in), default %d\n", usenuma);
-	printf ("  [-u turn off NUMA (if compiled in), default %d\n", usenuma);
-	printf ("  [-z <set cacheline size in bytes>] default %d\n",
-			  cacheLineSize);
+	double t, best = DBL_MAX;
+	int trial, ready;
+
+	if (pin_cpu (a) != 0)
+		return -1.0;
+	for (trial = 0; trial <= trials; trial++)
+	{
+		c2cLine = 0;
+		c2cCtl.cpu = b;
+		c2cCtl.kind = kind;
+		__atomic_add_fetch (&c2cCtl.gen, 1, __ATOMIC_RELEASE);
+		while ((ready = __atomic_load_n (&c2cReady, __ATOMIC_ACQUIRE))
+				 != c2cCtl.gen && ready != -c2cCtl.gen)
+			cpu_relax ();
+		if (ready < 0)
+			return -1.0;
+		t = second ();
+		c2c_bounce (kind, 1, C2C_ROUNDS);
+		/* the last pong */
+		while (__atomic_load_n (&c2cLine, __ATOMIC_ACQUIRE) != 2 * C2C_ROUNDS)
+			cpu_relax ();
+		t = (second () - t) * 1.0e9 / C2C_ROUNDS;
+		if (trial > 0 && t < best)
+			best = t;
+	}
+	return best;
 }
 
-char *
-fToStringDec (float x, char *result)
+void
+print_c2c (FILE * fp, char *title, double *m, int *cpu, int n)
 {
-	int shift = 0;
-	char *postfix = " kmgtp";
-	while (x > 1000)
+	int i, j;
+
+	fprintf (fp, "#%s round trip ns, rows = pinging cpu, columns = ponging cpu\n",
+				title);
+	fprintf (fp, "%-6s", "cpu");
+	for (j = 0; j < n; j++)
+		fprintf (fp, " %8d", cpu[j]);
+	fprintf (fp, "\n");
+	for (i = 0; i < n; i++)
 	{
-		x = x / 1000;
-		shift++;
+		fprintf (fp, "%-6d", cpu[i]);
+		for (j = 0; j < n; j++)
+		{
+			if (m[i * n + j] < 0)
+				fprintf (fp, " %8s", "n/a");
+			else
+				fprintf (fp, " %8.1f", m[i * n + j]);
+		}
+		fprintf (fp, "\n");
 	}
-	if (x < 10)
-		sprintf (result, "%4.3f%c", x, postfix[shift]);
-	else if (x < 100)
-		sprintf (result, "%4.2f%c", x, postfix[shift]);
-	else
-		sprintf (result, "%4.1f%c", x, postfix[shift]);
-
-	return (result);
 }
 
-char *
-fToStringBin (float x, char *result)
+void
+c2c_matrix (char *logfile)
 {
-	int shift = 0;
-	char *postfix = "KMGTP";
-	while (x > 1000.0)
+	int n = numCpus, i, j, kind;
+	int cpu[n > 0 ? n : 1];
+	double *m[2];
+	pthread_t helper;
+	FILE *fp;
+
+	if (n < 2)
 	{
-		x = x / 1024;
-		shift++;
+		printf ("--c2c needs at least 2 cpus, have %d\n", n);
+		exit (-1);
 	}
-	if (x < 10)
-		sprintf (result, "%4.3f%c", x, postfix[shift]);
-	else if (x < 100)
-		sprintf (result, "%4.2f%c", x, postfix[shift]);
-	else
-		sprintf (result, "%4.1f%c", x, postfix[shift]);
+	for (i = 0; i < n; i++)
+		cpu[i] = topo[i].cpu;
+	qsort (cpu, n, sizeof (int), compare_int);
+	m[0] = calloc ((size_t) n * n, sizeof (double));
+	m[1] = calloc ((size_t) n * n, sizeof (double));
+	fp = fopen (logfile, "w");
+	if (fp == NULL || m[0] == NULL || m[1] == NULL)
+	{
+		printf ("Can't write %s\n", logfile);
+		exit (-1);
+	}
+	pthread_create (&helper, NULL, c2c_thread, NULL);
+	for (i = 0; i < n; i++)
+	{
+		for (j = 0; j < n; j++)
+		{
+			if (i == j)
+				continue;
+			for (kind = C2C_STORE; kind <= C2C_CAS; kind++)
+				m[kind][i * n + j] = c2c_pair (cpu[i], cpu[j], kind);
+		}
+		printf ("cpu %d done\n", cpu[i]);
+	}
+	c2cCtl.quit = 1;
+	__atomic_add_fetch (&c2cCtl.gen, 1, __ATOMIC_RELEASE);
+	pthread_join (helper, NULL);
 
-	return (result);
+	fprintf (fp, "#c2c rounds=%d trials=%d timer=%s\n", C2C_ROUNDS, trials,
+				PSTREAM_CLOCK_NAME);
+	fprintf (fp, "#cpu package core l3 smt\n");
+	for (i = 0; i < numCpus; i++)
+		fprintf (fp, "#%d %d %d %d %d\n", topo[i].cpu, topo[i].package,
+					topo[i].core, topo[i].l3, topo[i].smt);
+	for (kind = C2C_STORE; kind <= C2C_CAS; kind++)
+	{
+		print_c2c (stdout, c2cName[kind], m[kind], cpu, n);
+		print_c2c (fp, c2cName[kind], m[kind], cpu, n);
+	}
+	fclose (fp);
+	free (m[0]);
+	free (m[1]);
 }
-
+#endif
 
 int
 main (int argc, char *argv[])
 {
 	double diff;
-	double max, min;
-	int64_t i, j, array_size, num_array;
-	int ret = 0;
-	pthread_t reader[MAX_THREADS];
-/* debugging */
-	double difft[2];
-	double results[2];
+	int64_t i, array_size;
 /*   printf ("argc=%d\n",argc); */
 	char *logfile = NULL;
 	int c = 0;
-	char result1[7], result2[7];
 	struct idThreadParams id;
-	struct idThreadParams tid[MAX_THREADS];
 
     id.minThreads = 1;
 	max_cpu=sysconf(_SC_NPROCESSORS_ONLN);
 	pageSize=sysconf(_SC_PAGESIZE);
 	cacheLineSize=sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
-	cacheSize=sysconf(_SC_LEVEL3_CACHE_SIZE);
-	id.maxThreads = max_cpu;
+	read_topology ();
+	/* the size of one L3 domain, sysconf's guess if sysfs has nothing */
+	cacheSize = l3Size > 0 ? l3Size : sysconf (_SC_LEVEL3_CACHE_SIZE);
+	id.maxThreads = numCpus > 0 ? numCpus : max_cpu;
 	perCacheLine = cacheLineSize / sizeof (int64_t);
 	cacheLinesPerPage = pageSize / cacheLineSize;
-	results[0] = 0;
-	results[1] = 0;
-
-	zero_bandwidth (id);
 	static struct option long_options[] =
 	{
 		{"shared",no_argument,&shared_cache,1},
 		{"sockets",required_argument,0,'b'},
+		{"isa",required_argument,0,OPT_ISA},
+		{"nt",no_argument,&ntStores,1},
+		{"kernels",required_argument,0,OPT_KERNELS},
+		{"mix",optional_argument,0,OPT_MIX},
+		{"strides",optional_argument,0,OPT_STRIDES},
+		{"gather",no_argument,0,OPT_GATHER},
+		{"engines",no_argument,0,OPT_ENGINES},
+		{"mlp",required_argument,0,OPT_MLP},
+		{"seed",required_argument,0,OPT_SEED},
+		{"trials",required_argument,0,OPT_TRIALS},
+		{"threads",required_argument,0,OPT_THREADS},
+		{"detail",required_argument,0,OPT_DETAIL},
+		{"barrier",required_argument,0,OPT_BARRIER},
+		{"spin-timeout",required_argument,0,OPT_SPIN_TIMEOUT},
+		{"tolerance",required_argument,0,OPT_TOLERANCE},
+		{"max-trials",required_argument,0,OPT_MAX_TRIALS},
+		{"counters",no_argument,0,OPT_COUNTERS},
+		{"raw-event",required_argument,0,OPT_RAW_EVENT},
+		{"pages",required_argument,0,OPT_PAGES},
+		{"numa-matrix",no_argument,&numaMatrix,1},
+		{"loaded",no_argument,&loadedMode,1},
+		{"c2c",no_argument,&c2cMatrix,1},
+		{"atomics",no_argument,&atomicsMode,1},
+		{"first-touch",no_argument,&firstTouch,1},
+		{"daemon",optional_argument,0,OPT_DAEMON},
+		{"duty",required_argument,0,OPT_DUTY},
+		{"rounds",required_argument,0,OPT_ROUNDS},
+		{"probes",required_argument,0,OPT_PROBES},
+		{"max-delay",required_argument,0,OPT_MAX_DELAY},
+		{"placement",required_argument,0,OPT_PLACEMENT},
+		{"adaptive",no_argument,&adaptive,1},
+		{"resolution",required_argument,0,OPT_RESOLUTION},
+		{"threshold",required_argument,0,OPT_THRESHOLD},
+		{"budget",required_argument,0,OPT_BUDGET},
 		{ 0,0,0,0 }
 	};
 
@@ -835,8 +4336,113 @@ main (int argc, char *argv[])
             printf (" with arg %s", optarg);
           printf ("\n");
           break;
+		case OPT_ISA:
+			for (isa = ISA_COUNT - 1; isa >= 0; isa--)
+			{
+				if (strcmp (optarg, isaName[isa]) == 0)
+					break;
+			}
+			if (isa < 0 && strcmp (optarg, "auto") != 0)
+			{
+				printf ("Unknown --isa %s, use auto, scalar, sse2, avx2 or avx512\n",
+						  optarg);
+				exit (-1);
+			}
+			break;
+		case OPT_KERNELS:
+			parse_kernels (optarg);
+			break;
+		case OPT_MIX:
+			parse_sweep ("mix", optarg ? optarg : MIX_DEFAULT);
+			break;
+		case OPT_STRIDES:
+			parse_sweep ("stride", optarg ? optarg : STRIDE_DEFAULT);
+			break;
+		case OPT_GATHER:
+			{
+				char kernels[] = GATHER_DEFAULT;
+				parse_kernels (kernels);
+			}
+			break;
+		case OPT_ENGINES:
+			numKernels = 0;
+			engines = 1;
+			break;
+		case OPT_COUNTERS:
+			useCounters = 1;
+			break;
+		case OPT_RAW_EVENT:
+			parse_raw_events (optarg);
+			break;
+		case OPT_RESOLUTION:
+			adaptResolution = 1.0 + atof (optarg) / 100.0;
+			break;
+		case OPT_THRESHOLD:
+			adaptThreshold = atof (optarg) / 100.0;
+			break;
+		case OPT_BUDGET:
+			adaptBudget = atof (optarg);
+			break;
+		case OPT_PAGES:
+			for (pages = PAGES_1G; pages >= 0; pages--)
+			{
+				if (strcasecmp (optarg, pagesName[pages]) == 0)
+					break;
+			}
+			if (pages < 0)
+			{
+				printf ("Unknown --pages %s, use 4k, thp, 2m or 1g\n", optarg);
+				exit (-1);
+			}
+			break;
+		case OPT_TRIALS:
+			trials = atoi (optarg);
+			if (trials < 1)
+			{
+				printf ("--trials needs at least 1\n");
+				exit (-1);
+			}
+			break;
+		case OPT_TOLERANCE:
+			tolerance = atof (optarg) / 100.0;
+			break;
+		case OPT_MAX_TRIALS:
+			maxTrials = atoi (optarg);
+			break;
+		case OPT_SEED:
+			seed = strtoull (optarg, NULL, 0);
+			break;
+		case OPT_MLP:
+			mlpMax = atoi (optarg);
+			if (mlpMax < 1 || mlpMax > MAX_CHAINS || (mlpMax & (mlpMax - 1)))
+			{
+				printf ("--mlp takes a power of two from 1 to %d\n", MAX_CHAINS);
+				exit (-1);
+			}
+			break;
+		case OPT_PLACEMENT:
+			for (placement = PLACE_SMT; placement > PLACE_NONE; placement--)
+			{
+				if (strcmp (optarg, placeName[placement]) == 0)
+					break;
+			}
+			if (placement == PLACE_NONE)
+			{
+				printf ("Unknown --placement %s, use compact, socket, l3, core or smt\n",
+						  optarg);
+				exit (-1);
+			}
+			affinity = 1;
+#ifndef USEAFFINITY
+			printf
+				("Sorry, not compiled with affinity support, use -DAFFINITY\n");
+			exit (-1);
+#endif
+			break;
 		case 'a':
 			affinity = 1;
+			if (placement == PLACE_NONE)
+				placement = PLACE_COMPACT;
 #ifndef USEAFFINITY
 			printf
 				("Sorry, not compiled with affinity support, use -DAFFINITY\n");
@@ -862,7 +4468,7 @@ main (int argc, char *argv[])
 				band = 1;
 			break;
 		case 'c':
-			cacheSize = atoi (optarg) * 1024;
+			cacheSize = parse_size (optarg, 1024, 1, "-c");
 			break;
 		case 'S':
 			spread = atoi (optarg) ;
@@ -880,10 +4486,10 @@ main (int argc, char *argv[])
 				lat = 1;
 			break;
 		case 'm':
-			minMemory = atoi (optarg) * 1024;
+			minMemory = parse_size (optarg, 1024, 0, "-m");
 			break;
 		case 'M':
-			maxMemory = (int64_t) atoi (optarg) * 1024 * 1024;
+			maxMemory = parse_size (optarg, 1024 * 1024, 0, "-M");
 			break;
 		case 'p':
 			numPages = atoi (optarg);
@@ -899,16 +4505,48 @@ main (int argc, char *argv[])
 			break;
 		case 'T':
 			id.maxThreads = atoi (optarg);
-			if (id.maxThreads > MAX_THREADS)
+			break;
+		case OPT_BARRIER:
+			for (barrierKind = BARRIER_TREE; barrierKind >= 0; barrierKind--)
+				if (strcmp (optarg, barrierName[barrierKind]) == 0)
+					break;
+			if (barrierKind < 0)
+			{
+				printf ("Unknown --barrier %s, use spin, tree or block\n", optarg);
+				exit (-1);
+			}
+			break;
+		case OPT_SPIN_TIMEOUT:
+			spinTimeout = atof (optarg) * 1.0e-6;
+			break;
+		case OPT_PROBES:
+			probes = atoi (optarg);
+			break;
+		case OPT_MAX_DELAY:
+			maxDelay = atoll (optarg);
+			break;
+		case OPT_DAEMON:
+			daemonMode = 1;
+			if (optarg)
+				probeInterval = atof (optarg);
+			break;
+		case OPT_DUTY:
+			probeDuty = atof (optarg);
+			if (probeDuty <= 0.0 || probeDuty > 100.0)
 			{
-				printf
-					("Maximum number of threads exceeds the array size of %d.\n",
-					 MAX_THREADS);
-				printf
-					("Please use a number lower value or recompile with a larger MAX_THREADS\n");
+				printf ("--duty must be more than 0 and at most 100\n");
 				exit (-1);
 			}
 			break;
+		case OPT_ROUNDS:
+			probeRounds = atoll (optarg);
+			break;
+		case OPT_DETAIL:
+			detailName = optarg;
+			break;
+		case OPT_THREADS:
+			threadSpec = optarg;
+			break;
 
 		case 'U':
 			usenuma = 1;
@@ -932,119 +4570,248 @@ main (int argc, char *argv[])
 		printf ("You must specify a log file with -f\n");
 		exit (-1);
 	}
-	if ((band + lat) != 1)
+	if (numaMatrix)
+	{
+#ifdef USENUMA
+		if (numa_available () < 0)
+		{
+			printf ("Sorry, NUMA is not available on this system\n");
+			exit (-1);
+		}
+#else
+		printf ("Sorry, not compiled with NUMA support, use -DUSENUMA\n");
+		exit (-1);
+#endif
+		band = 1;
+		lat = 0;
+	}
+	if (loadedMode || c2cMatrix || daemonMode)
+	{
+		band = 1;
+		lat = 0;
+	}
+	if (atomicsMode || firstTouch)
+	{
+		band = lat = 0;
+		/* nothing is wired up to the counters in these modes */
+		if (firstTouch)
+			useCounters = 0;
+	}
+	else if ((band + lat) != 1)
 	{
 		printf ("you must pick exactly 1 of bandwdth and latency testing\n");
 		exit (-1);
 	}
+	/* the matrix and loaded modes only use -M */
+	if (minMemory > maxMemory && !numaMatrix && !loadedMode && !c2cMatrix
+		 && !atomicsMode && !firstTouch && !daemonMode)
+	{
+		printf ("-m %" PRId64 "K is larger than -M %" PRId64 "K\n",
+				  minMemory / 1024, maxMemory / 1024);
+		exit (-1);
+	}
+	select_isa ();
+	if (engines)
+		add_engines ();
+	if (numKernels == 0)
+	{
+		char kernels[] = "add,triad";
+		parse_kernels (kernels);
+	}
+	mark_aliases ();
+	/* one bandwidth point per probe */
+	if (daemonMode)
+		numKernels = 1;
+	build_schedule (&id);
+	alloc_tables (id.maxThreads);
+	if (placement != PLACE_NONE)
+		place_threads ();
+	if (useCounters)
+	{
+		/* the default events go first, --raw-event ones after them */
+		int n = sizeof (counterDefaults) / sizeof (counterDefaults[0]);
+		if (numCounters + n > MAX_COUNTERS)
+			n = MAX_COUNTERS - numCounters;
+		memmove (counterTable + n, counterTable,
+					numCounters * sizeof (counterTable[0]));
+		memcpy (counterTable, counterDefaults, n * sizeof (counterTable[0]));
+		numCounters += n;
+		counters_probe ();
+	}
+	if (seed == 0)
+		seed = ((uint64_t) time (NULL) << 20) ^ (uint64_t) getpid ();
+#ifdef USENUMA
+	if (firstTouch && numa_available () >= 0)
+	{
+		/* a second node with memory we may use */
+		int n = next_mem_node (0);
+		if (next_mem_node (n) != n)
+			touchPlaces = 2;
+	}
+#endif
+	setup_columns ();
 	printf
-		("minMemory=%d maxMemory=%" PRIu64
+		("minMemory=%" PRId64 " maxMemory=%" PRIu64
 		 " minThreads=%d maxThreads=%d writing to %s band=%d lat=%d\n",
 		 minMemory, maxMemory, id.minThreads, id.maxThreads, logfile, band, lat);
 	printf ("increaseArray=%f timestep=%f cacheSize=%" PRIu64
 			  " cacheLineSize=%d\n", increaseArray, timeStep, cacheSize,
 			  cacheLineSize);
 	printf ("affinity=%d affinity_wide=%d shared=%d\n", affinity, affinity_wide,shared_cache);
-	printf ("usenuma=%d numPages=%d\n", usenuma, numPages);
+	printf ("cpus=%d l3Size=%" PRIu64 " placement=%s", numCpus, l3Size,
+			  placeName[placement]);
+	for (i = 0; i < placeCount && i < id.maxThreads; i++)
+		printf ("%s%d", i ? "," : " order=", placeOrder[i]);
+	printf ("\n");
+	printf ("pages=%s\n", pagesName[pages]);
+	printf ("usenuma=%d numPages=%d seed=%" PRIu64 "\n", usenuma, numPages,
+			  seed);
+	printf ("isa=%s ntStores=%d\n", isaName[isa], ntStores);
+	if (adaptive)
+		printf ("adaptive resolution=%f threshold=%f budget=%f\n",
+				  adaptResolution, adaptThreshold, adaptBudget);
+	printf ("barrier=%s spinTimeout=%fs\n", barrierName[barrierKind],
+			  spinTimeout);
+	printf ("threads=");
+	for (i = 0; i < numSteps; i++)
+		printf ("%s%d", i ? "," : "", schedule[i]);
+	printf ("\n");
+	printf ("trials=%d tolerance=%f maxTrials=%d timer=%s resolution=%gs\n",
+			  trials, tolerance, maxTrials, PSTREAM_CLOCK_NAME,
+			  second_resolution ());
+	/* whenever a point can take more than one trial */
+	if (trials > 1 || (tolerance > 0 && maxTrials > 1))
+	{
+		char name[strlen (logfile) + 8];
+		sprintf (name, "%s.stats", logfile);
+		statsFile = fopen (name, "w");
+		if (statsFile == NULL)
+		{
+			printf ("Can't write %s\n", name);
+			exit (-1);
+		}
+		fprintf (statsFile, "#threads sizeKB column best min median mean "
+					"stddev p95 trials\n");
+	}
+	if (detailName)
+	{
+		detailFile = fopen (detailName, "w");
+		if (detailFile == NULL)
+		{
+			printf ("Can't write %s\n", detailName);
+			exit (-1);
+		}
+		fprintf (detailFile, "#threads sizeKB trial column startSkewUs "
+					"endSkewUs min max mean imbalance worst cpu : per thread\n");
+	}
+	if (band)
+	{
+		printf ("kernels=");
+		for (i = 0; i < numKernels; i++)
+			printf ("%s%s", i ? "," : "", kernelList[i].name);
+		printf ("\n");
+	}
 
+#ifdef USENUMA
+	if (numaMatrix)
+	{
+		numa_matrix (logfile, id.maxThreads);
+		if (statsFile)
+			fclose (statsFile);
+		if (detailFile)
+			fclose (detailFile);
+		return (0);
+	}
+#endif
+	if (loadedMode)
+	{
+		if (probes < 1 || probes >= id.maxThreads)
+		{
+			printf ("--loaded needs at least one probe and one load thread, "
+					  "%d probes with -T %d\n", probes, id.maxThreads);
+			exit (-1);
+		}
+		loaded_latency (logfile, id.maxThreads);
+		if (statsFile)
+			fclose (statsFile);
+		if (detailFile)
+			fclose (detailFile);
+		return (0);
+	}
+	if (atomicsMode)
+	{
+		atomics_sweep (logfile, id.maxThreads);
+		if (statsFile)
+			fclose (statsFile);
+		if (detailFile)
+			fclose (detailFile);
+		return (0);
+	}
+	if (daemonMode)
+	{
+		printf ("daemon interval=%fs duty=%f%% rounds=%lld\n", probeInterval,
+				  probeDuty, probeRounds);
+		daemon_probes (logfile);
+		if (statsFile)
+			fclose (statsFile);
+		if (detailFile)
+			fclose (detailFile);
+		return (0);
+	}
+	if (firstTouch)
+	{
+		printf ("first-touch nodes=%d\n", touchPlaces);
+		touch_sweep (logfile);
+		if (statsFile)
+			fclose (statsFile);
+		if (detailFile)
+			fclose (detailFile);
+		return (0);
+	}
+	if (c2cMatrix)
+	{
+#ifdef USEAFFINITY
+		c2c_matrix (logfile);
+#else
+		printf ("Sorry, not compiled with affinity support, use -DUSEAFFINITY\n");
+#endif
+		return (0);
+	}
 	begin = second ();
-	cur_threads = id.minThreads;
-	while (cur_threads <= id.maxThreads)
+	if (!adaptive)
+		init_rows ();
+	for (curStep = 0; curStep < numSteps; curStep++)
 	{
+		cur_threads = schedule[curStep];
 		printf ("*** threads=%d\n", cur_threads);
+		pool_start (cur_threads, maxMemory / cur_threads);
+		releaseSkew[curStep] = barrier_skew ();
+		if (adaptive)
+		{
+			/* split what is left of the budget over the remaining counts */
+			adaptive_sweep (second () + (begin + adaptBudget - second ()) /
+								 (numSteps - curStep));
+			pool_stop ();
+			continue;
+		}
 		array_size = maxMemory;	/* start large and shrink to keep malloc happy */
 		/* Insure that every array is an even multiple of the cacheline size */
-		diff = timeStep;
 		scale = REPEAT;
-		num_array = 0;
 
 		while (array_size >= minMemory)
 		{
-			scale = scale * (timeStep / diff);
-			if (scale<1) {
-				scale=1;
-			}
-			for (i = 0; i < MAX_THREADS; i++)
-			{
-				for (j = 0; j < (BENCHMARKS * 2); j++)
-				{
-				}
-			}
-			for (i = 0; i < cur_threads; i++)
-			{
-				tid[i].id = i;
-				tid[i].maxThreads= cur_threads;
-				/* maxmem = bytes per thread to use */
-				maxmem = array_size / cur_threads;
-				if (band == 1)
-					ret =
-						pthread_create (&(reader[i]), NULL, stream_thread, &tid[i]);
-				if (lat == 1)
-					ret =
-						pthread_create (&(reader[i]), NULL, latency_thread, &tid[i]);
-
-				if (ret != 0)
-				{
-					printf ("ret=%d, pthread_create failed!!\n", ret);
-					exit (-1);
-				}
-				else
-				{
-/*			printf ("thread %d created ret=%d\n",i,ret); */
-				}
-
-			}
-			for (i = 0; i < cur_threads; i++)
-			{
-				ret = pthread_join (reader[i], NULL);
-#ifdef DEBUG
-				printf ("join ret val=%d i=%d\n", ret, i);
-#endif
-			}
-
-			printf ("%d Thread(s) size=%sB repeat=%s ", cur_threads,
-					  fToStringBin (array_size / 1024.0, result1),
-					  fToStringDec ((float) scale, result2));
-			for (i = 0; i < BENCHMARKS; i++)
-			{
-/*	printf ("max=%f min=%f\n",DBL_MAX,DBL_MIN); */
-#ifndef PGCC_BROKEN
-				min = DBL_MAX;
-				max = DBL_MIN;
-#else
-				min = 1.7976931348623157e+208;
-				max = 2.2250738585072014e-208;
-#endif
-
-				for (j = 0; j < cur_threads; j++)
-				{
-					if (timeAr[j][i * 2] < min)
-					{
-						min = timeAr[j][i * 2];
-					}
-					if (timeAr[j][i * 2 + 1] > max)
-					{
-						max = timeAr[j][i * 2 + 1];
-					}
-				}
-				difft[i] = max - min;
-			}
-			if (difft[0] > 0 && difft[1]>0) {
-			diff = difft[0];
-			if (lat == 1)
-				latency_time (difft, results, maxmem, scale, cur_threads);
-			if (band == 1)
-				bandwidth_time (difft, results, maxmem, scale, cur_threads);
-			bandwidthAr[logint (cur_threads)][num_array][0] = results[0];
-			bandwidthAr[logint (cur_threads)][num_array][1] = results[1];
-/*	      printf ("cur=%d index=%d\n", cur_threads, log[cur_threads]); */
-			printf ("\n");
-			}
+			/* calibrate starts from the last point's scale */
+			run_point (array_size, &diff);
 			array_size = array_size * increaseArray;
-			num_array++;
+			scale = scale / increaseArray;
 		}
-		cur_threads = cur_threads * 2;
+		pool_stop ();
 	}
+	print_crossovers (stdout, "");
 	print_bandwidth (logfile,id);
+	if (statsFile)
+		fclose (statsFile);
+	if (detailFile)
+		fclose (detailFile);
 	return (0);
 }